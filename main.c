@@ -40,6 +40,10 @@
 //
 //*****************************************************************************
 
+// jnc begin
+#define _GNU_SOURCE
+// jnc end
+
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -49,25 +53,72 @@
 
 // jnc begin
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <locale.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <termios.h>
+#include <time.h>
+#include <wchar.h>
+
+#ifdef PINA_HAVE_LIBESPEAK_NG
+#include <espeak-ng/speak_lib.h>
+#endif
+
+#ifdef PINA_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "pina_shell.h"
 // jnc end
 
 //  Function Declarations for builtin shell commands:
 int lsh_cd(char **args);
 int lsh_help(char **args);
 int lsh_exit(char **args);
+int lsh_stats(char **args);
+int lsh_announce(char **args);
+int lsh_replay(char **args);
+int lsh_alerts(char **args);
 
 /// List of builtin commands, followed by their corresponding functions.
 char *builtin_str[] = {
   "cd",
   "help",
-  "exit"
+  "exit",
+  "stats",
+  "announce",
+  "replay",
+  "review-session",
+  "alerts"
 };
 
 int (*builtin_func[]) (char **) = {
   &lsh_cd,
   &lsh_help,
-  &lsh_exit
+  &lsh_exit,
+  &lsh_stats,
+  &lsh_announce,
+  &lsh_replay,
+  &lsh_replay,
+  &lsh_alerts
 };
 
 int lsh_num_builtins() {
@@ -77,311 +128,4963 @@ int lsh_num_builtins() {
 
 // jnc begin
 int lsh_execute(char **args, int bool_int);
-
-char **lsh_split_line(char *line);
-
-// Node structure for a linked list
-typedef struct Node {
-    char *data;
-    struct Node *next;
-    struct Node *prev;
-} Node;
-
-// Linked list structure
-typedef struct LinkedList {
-    Node *head;
-    Node *tail;
-    int size;
-} LinkedList;
-
+int lookup_command(const char *word, char **suggestion);
 
 // Global linked list
 LinkedList list;
 
-void speak_audio(char *text) {
+// ***************************************************************
+// Growable byte buffer ( implementation ).
+
+typedef struct DynBuffer {
+    char   *data;
+    size_t  len;
+    size_t  capacity;
+} DynBuffer;
+
+void dyn_buffer_init(DynBuffer *buf) {
+    buf->data     = NULL;
+    buf->len      = 0;
+    buf->capacity = 0;
+}
 
-    char *espeak_ng   = "espeak-ng";
-    char *punctuation = "--punct";
+// Appends len bytes and keeps the buffer null terminated.
+void dyn_buffer_append(DynBuffer *buf, const char *data, size_t len) {
+    if (buf->len + len + 1 > buf->capacity) {
+        size_t new_capacity = buf->capacity ? buf->capacity : 1024;
+        while (buf->len + len + 1 > new_capacity) {
+            new_capacity *= 2;
+        }
+        char *new_data = realloc(buf->data, new_capacity);
+        if (!new_data) {
+            fprintf(stderr, "pina_shell: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        buf->data     = new_data;
+        buf->capacity = new_capacity;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
 
-    // Allocate memory for the new string:
-    // length of text + 2 for the double quotes + 1 for the null-terminator
-    char * text_with_quotes = (char*) malloc(
-                + strlen( espeak_ng )   + 2
-                + strlen( punctuation ) + 2
-                + strlen( text ) + 3 
-                + 2 );   // 2 Quotes (not the double quotes)
+void dyn_buffer_free(DynBuffer *buf) {
+    free(buf->data);
+    dyn_buffer_init(buf);
+}
 
-    sprintf( text_with_quotes, "%s %s \"'%s'\"", espeak_ng, punctuation, text ); 
+// ***************************************************************
 
-    // printf("text_with_quotes: %s\n", text_with_quotes);
 
-    char ** speak_ng_command_args = lsh_split_line( text_with_quotes );
+// ***************************************************************
+// UTF-8 ( implementation ).
+//
+// The keyboard and the outputs are UTF-8: a code point, like the "ç" or
+// the "ã" of Portuguese, is one key, one utterance and one backspace, and
+// takes the columns given by wcwidth() on the screen.
+
+// Length of the sequence that starts with the byte c, 0 if c can't start one.
+int utf8_sequence_length(unsigned char c) {
+    if (c < 0x80) {
+        return 1;
+    } else if (c >= 0xC2 && c <= 0xDF) {
+        return 2;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        return 3;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        return 4;
+    }
+    return 0;
+}
 
-    // Print to verify speak_ng_command_args
-    // for (int i = 0; i < 2; i++) {
-    //     printf("args[%d]: %s\n", i, speak_ng_command_args[i]);
-    // }
+int utf8_is_continuation(unsigned char c) {
+    return (c & 0xC0) == 0x80;
+}
 
-    int dont_gen_pipes_dont_capture_output = 0;
-    int status = lsh_execute( speak_ng_command_args, dont_gen_pipes_dont_capture_output );
+///  @brief Decodes the code point at s.
+///  @param len The bytes available at s.
+///  @return The length of the sequence, or 0 if it isn't valid UTF-8.
+int utf8_decode(const char *s, size_t len, uint32_t *code_point) {
+    const unsigned char *u = (const unsigned char *) s;
+    int n = utf8_sequence_length(u[0]);
+    if (n == 0 || (size_t) n > len) {
+        return 0;
+    }
+    uint32_t cp = (n == 1) ? u[0] : (u[0] & (0x7F >> n));
+    for (int i = 1; i < n; i++) {
+        if (!utf8_is_continuation(u[i])) {
+            return 0;
+        }
+        cp = (cp << 6) | (u[i] & 0x3F);
+    }
+    // Overlong encodings, UTF-16 surrogates and beyond U+10FFFF.
+    static const uint32_t min_code_point[5] = { 0, 0, 0x80, 0x800, 0x10000 };
+    if (cp < min_code_point[n] || (cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF) {
+        return 0;
+    }
+    *code_point = cp;
+    return n;
+}
 
-    free( text_with_quotes );
-    free( speak_ng_command_args );
+// Start of the code point that ends at pos.
+size_t utf8_prev(const char *s, size_t pos) {
+    size_t start = pos;
+    while (start > 0 && pos - start < 4) {
+        start--;
+        if (!utf8_is_continuation((unsigned char) s[start])) {
+            return start;
+        }
+    }
+    return pos > 0 ? pos - 1 : 0;
 }
 
-void speak_audio_char(char char_value) {
-    char char_str[2];
-    char_str[0] = char_value;
-    char_str[1] = '\0';
-    speak_audio( char_str );
+// Start of the code point after the one at pos.
+size_t utf8_next(const char *s, size_t len, size_t pos) {
+    uint32_t cp;
+    int n = utf8_decode(s + pos, len - pos, &cp);
+    return pos + (n > 0 ? n : 1);
 }
 
+///  @brief The column after writing len bytes of s from column, with the
+///         tabs to the next multiple of 8 and invalid bytes one column.
+int utf8_columns(const char *s, size_t len, int column) {
+    size_t i = 0;
+    while (i < len) {
+        uint32_t cp;
+        int n = utf8_decode(s + i, len - i, &cp);
+        if (n == 0) {
+            column++;
+            i++;
+            continue;
+        }
+        if (cp == '\t') {
+            column = (column / 8 + 1) * 8;
+        } else {
+            int width = wcwidth((wchar_t) cp);
+            column += (width >= 0) ? width : 1;
+        }
+        i += n;
+    }
+    return column;
+}
 
 // ***************************************************************
-// Double linked list of strings ( implementation ).
 
-// Function to initialize the linked list
-void list_init(LinkedList *list) {
-    list->head = NULL;
-    list->tail = NULL;
-    list->size = 0;
+
+// ***************************************************************
+// Spill buffer ( implementation ).
+//
+// A growable byte buffer that keeps at most PINA_SPILL_WINDOW bytes in
+// memory: beyond that the data goes to an unlinked temporary file, and is
+// read back through mmap. Huge outputs cost disk and page cache, not RSS.
+
+#define PINA_SPILL_WINDOW (256 * 1024)
+
+typedef struct SpillBuffer {
+    DynBuffer  window;    // All the data while small, then what isn't written yet.
+    int        fd;        // The temporary file, -1 while all is in memory.
+    size_t     file_len;  // Bytes written to the file.
+    char      *map;       // Read only view of the file.
+    size_t     map_len;
+} SpillBuffer;
+
+void spill_buffer_init(SpillBuffer *sb) {
+    dyn_buffer_init(&sb->window);
+    sb->fd       = -1;
+    sb->file_len = 0;
+    sb->map      = NULL;
+    sb->map_len  = 0;
 }
 
-// Append a string to the beginning of the linked list
-void list_append_first(LinkedList *list, char *str) {
-    Node *newNode = (Node *)malloc(sizeof(Node));
-    newNode->data = strdup(str);  // Copy the string
-    newNode->next = list->head;
-    newNode->prev = NULL;
+void spill_buffer_free(SpillBuffer *sb) {
+    dyn_buffer_free(&sb->window);
+    if (sb->map != NULL) {
+        munmap(sb->map, sb->map_len);
+    }
+    if (sb->fd >= 0) {
+        close(sb->fd);
+    }
+    spill_buffer_init(sb);
+}
 
-    if (list->head) {
-        list->head->prev = newNode;
-    } else {
-        // If the list is empty, new node is also the tail
-        list->tail = newNode;
+size_t spill_buffer_len(SpillBuffer *sb) {
+    return sb->file_len + sb->window.len;
+}
+
+// Creates the unlinked temporary file, in $TMPDIR or /tmp.
+int spill_buffer_open_file(void) {
+    const char *dir = getenv("TMPDIR");
+    if (dir == NULL || dir[0] == '\0') {
+        dir = "/tmp";
     }
 
-    list->head = newNode;
-    list->size++;
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        // File systems without O_TMPFILE.
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/pina_shell.XXXXXX", dir);
+        fd = mkostemp(path, O_CLOEXEC);
+        if (fd != -1) {
+            unlink(path);
+        }
+    }
+    return fd;
 }
 
-// Get data at a specific index
-char *list_get_at(LinkedList *list, int index) {
-    if (index < 0 || index >= list->size) {
-        return NULL;  // Out of bounds
+void spill_buffer_write(SpillBuffer *sb, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(sb->fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pina_shell: spill file");
+            exit(EXIT_FAILURE);
+        }
+        data         += n;
+        len          -= n;
+        sb->file_len += n;
     }
+}
 
-    Node *current = list->head;
-    for (int i = 0; i < index; i++) {
-        current = current->next;
+// Writes the window to the file.
+void spill_buffer_flush(SpillBuffer *sb) {
+    if (sb->fd >= 0 && sb->window.len > 0) {
+        spill_buffer_write(sb, sb->window.data, sb->window.len);
+        sb->window.len = 0;
     }
-    return current->data;
 }
 
-// Delete a node from the list
-void list_delete(LinkedList *list, Node *node) {
-    if (node->prev) {
-        node->prev->next = node->next;
-    } else {
-        // If node is head
-        list->head = node->next;
+void spill_buffer_append(SpillBuffer *sb, const void *data, size_t len) {
+    if (sb->fd < 0 && sb->window.len + len > PINA_SPILL_WINDOW) {
+        sb->fd = spill_buffer_open_file();
+        if (sb->fd < 0) {
+            // No temporary file, everything stays in memory.
+            perror("pina_shell: spill file");
+        }
     }
 
-    if (node->next) {
-        node->next->prev = node->prev;
-    } else {
-        // If node is tail
-        list->tail = node->prev;
+    if (sb->fd >= 0 && sb->window.len + len > PINA_SPILL_WINDOW) {
+        spill_buffer_flush(sb);
+        if (len > PINA_SPILL_WINDOW) {
+            spill_buffer_write(sb, data, len);
+            return;
+        }
     }
+    dyn_buffer_append(&sb->window, data, len);
+}
 
-    free(node->data);
-    free(node);
-    list->size--;
+///  @brief A contiguous view of all the data, valid until the next append.
+const char *spill_buffer_data(SpillBuffer *sb) {
+    if (sb->fd < 0) {
+        return sb->window.data ? sb->window.data : "";
+    }
+
+    spill_buffer_flush(sb);
+    if (sb->map_len != sb->file_len) {
+        if (sb->map != NULL) {
+            munmap(sb->map, sb->map_len);
+        }
+        sb->map = mmap(NULL, sb->file_len, PROT_READ, MAP_SHARED, sb->fd, 0);
+        if (sb->map == MAP_FAILED) {
+            perror("pina_shell: mmap");
+            exit(EXIT_FAILURE);
+        }
+        sb->map_len = sb->file_len;
+    }
+    return sb->map;
 }
 
-// Get the first node
-Node *list_first(LinkedList *list) {
-    return list->head;
+// ***************************************************************
+
+
+// ***************************************************************
+// Speech backends ( implementation ).
+//
+// All the speech goes through speak_audio(), that hands it to the backend
+// selected with the PINA_TTS environment variable:
+//
+//   espeak-ng    runs the espeak-ng command for each utterance ( default ).
+//   lookahead    synthesizes the next sentences with espeak-ng on a pool of
+//                threads while the current one plays, without gaps.
+//   libespeak-ng synthesizes in-process ( make LIBESPEAK=1 ).
+//   wav          appends the synthesized audio to the file in PINA_TTS_WAV
+//                ( default pina_shell.wav ), nothing is played.
+//   null         speaks nothing, only records the timing of the utterances,
+//                to the file in PINA_TTS_LOG if set and as a summary at exit.
+//   socket       sends the text to a local speech daemon that speaks SSIP
+//                ( speech-dispatcher ), on the Unix socket in PINA_TTS_SOCKET
+//                or $XDG_RUNTIME_DIR/speech-dispatcher/speechd.sock.
+//   daemon       sends the text to the pina_shell speech daemon, shared by
+//                all the shells of the user, and starts it if needed.
+//
+// PINA_TTS_RATE sets the rate in words per minute.
+
+// Priorities of the utterances, the most important first ( see the speech
+// queues below ).
+#define PINA_SPEECH_ECHO       0
+#define PINA_SPEECH_ERROR      1
+#define PINA_SPEECH_PROMPT     2
+#define PINA_SPEECH_NARRATION  3
+#define PINA_SPEECH_PRIORITIES 4
+
+typedef struct SpeechBackend {
+    const char *name;
+    int  (*open)(void);                    // Returns 0, or -1 if unavailable.
+    void (*speak)(const char *text);       // Queues one utterance.
+    void (*cancel)(void);                  // Silences the speech now.
+    void (*flush)(void);                   // Waits until all was spoken.
+    int  (*busy)(void);                    // 1 while it can't take more.
+    void (*set_rate)(int words_per_minute);
+    void (*close)(void);
+} SpeechBackend;
+
+// Rate in words per minute, 0 for the synthesizer default.
+int tts_rate = 0;
+
+// Size of the header of the WAV files written by espeak-ng.
+#define TTS_WAV_HEADER_SIZE 44
+
+double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-// Get the last node
-Node *list_last(LinkedList *list) {
-    return list->tail;
+// Text that starts with '-' would be taken by espeak-ng as an option.
+const char * tts_text_argument(const char *text, char **to_free) {
+    *to_free = NULL;
+    if (text[0] == '-') {
+        *to_free = malloc(strlen(text) + 2);
+        if (*to_free) {
+            sprintf(*to_free, " %s", text);
+            return *to_free;
+        }
+    }
+    return text;
 }
 
-// Get the next node
-Node *list_next(Node *node) {
-    return node->next;
+// Fills args with the espeak-ng command line for the text, and extra_arg
+// if not NULL. rate is a buffer for the rate, *to_free must be freed.
+void tts_espeak_ng_args(const char *text, const char *extra_arg, const char *args[8],
+                        char rate[16], char **to_free) {
+    int n = 0;
+
+    args[n++] = "espeak-ng";
+    args[n++] = "--punct";
+    if (tts_rate > 0) {
+        snprintf(rate, 16, "%d", tts_rate);
+        args[n++] = "-s";
+        args[n++] = rate;
+    }
+    if (extra_arg != NULL) {
+        args[n++] = extra_arg;
+    }
+    args[n++] = tts_text_argument(text, to_free);
+    args[n]   = NULL;
 }
 
-// Get the previous node
-Node *list_prev(Node *node) {
-    return node->prev;
+// Child process: execs espeak-ng with the text, and extra_arg if not NULL.
+void tts_exec_espeak_ng(const char *text, const char *extra_arg) {
+    char rate[16];
+    char *to_free;
+    const char *args[8];
+
+    // The signals blocked by the event loop, so that a hangup still stops
+    // an espeak-ng left behind by the shell.
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    tts_espeak_ng_args(text, extra_arg, args, rate, &to_free);
+    execvp(args[0], (char **) args);
+    perror("espeak-ng");
+    _exit(127);
 }
 
-// Get the node data
-char *list_get_data(Node *node) {
-    return node->data;
+
+// espeak-ng command backend.
+
+pid_t tts_espeak_pid = 0;
+
+int tts_espeak_open(void) {
+    return 0;
 }
 
-// Function to free up memory for entire list
-void list_free(LinkedList *list) {
-    Node *current = list->head;
-    while (current) {
-        Node *nextNode = current->next;
-        free(current->data);
-        free(current);
-        current = nextNode;
+void tts_espeak_flush(void) {
+    if (tts_espeak_pid > 0) {
+        int status;
+        while (waitpid(tts_espeak_pid, &status, 0) == -1 && errno == EINTR) {
+        }
+        tts_espeak_pid = 0;
     }
 }
 
-void list_print_reverse(LinkedList *list) {
-    int list_size = list->size;    
-    
-    if (list_size > 15 /* 12 */) {
-        // Remove the last element
-        list_delete( list, list->tail );
+int tts_espeak_busy(void) {
+    if (tts_espeak_pid > 0) {
+        int status;
+        if (waitpid(tts_espeak_pid, &status, WNOHANG) == 0) {
+            return 1;
+        }
+        tts_espeak_pid = 0;
     }
-    
-    list_size = list->size - 1;
-    Node *current = list->tail;  // Start by the end (tail)
-    while (current) {
-        printf(" %2d : %s\n", list_size--, current->data);
-        current = current->prev;  // Navigate to the previous element.
+    return 0;
+}
+
+void tts_espeak_speak(const char *text) {
+    // One utterance at a time, in order.
+    tts_espeak_flush();
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        tts_exec_espeak_ng(text, NULL);
+    } else if (pid < 0) {
+        perror("pina_shell: fork");
+    } else {
+        tts_espeak_pid = pid;
     }
 }
 
-// ***************************************************************
+void tts_espeak_cancel(void) {
+    if (tts_espeak_pid > 0) {
+        // SIGKILL, a SIGTERM could let it finish writing its audio buffer.
+        kill(tts_espeak_pid, SIGKILL);
+        tts_espeak_flush();
+    }
+}
 
+void tts_espeak_set_rate(int words_per_minute) {
+    tts_rate = words_per_minute;
+}
 
-int FALSE = 0;
-int TRUE  = 1;
+void tts_espeak_close(void) {
+    tts_espeak_flush();
+}
 
-int is_all_whitespace(char *str) {
-    while (*str) {
-        if (!isspace((unsigned char)*str))
-            return FALSE;
-        str++;
+
+#ifdef PINA_HAVE_LIBESPEAK_NG
+
+// libespeak-ng in-process backend.
+
+int tts_libespeak_open(void) {
+    if (espeak_Initialize(AUDIO_OUTPUT_PLAYBACK, 0, NULL, 0) == EE_INTERNAL_ERROR) {
+        return -1;
     }
-    return TRUE;
+    espeak_SetParameter(espeakPUNCTUATION, espeakPUNCT_ALL, 0);
+    return 0;
 }
 
-// jnc end
+void tts_libespeak_speak(const char *text) {
+    espeak_Synth(text, strlen(text) + 1, 0, POS_CHARACTER, 0, espeakCHARS_AUTO, NULL, NULL);
+}
 
+void tts_libespeak_cancel(void) {
+    espeak_Cancel();
+}
 
-// ____________________________________________________________________________
-// Builtin function implementations.
+void tts_libespeak_flush(void) {
+    espeak_Synchronize();
+}
 
+int tts_libespeak_busy(void) {
+    return espeak_IsPlaying();
+}
 
-///  @brief Builtin command: change directory.
-///  @param args List of args.  args[0] is "cd".  args[1] is the directory.
-///  @return Always returns 1, to continue executing.
-int lsh_cd(char **args)
-{
-  if (args[1] == NULL) {
-    fprintf(stderr, "pina_shell: expected argument to \"cd\"\n");
+void tts_libespeak_set_rate(int words_per_minute) {
+    tts_rate = words_per_minute;
+    if (words_per_minute > 0) {
+        espeak_SetParameter(espeakRATE, words_per_minute, 0);
+    }
+}
 
-    // jnc inicio
+void tts_libespeak_close(void) {
+    espeak_Synchronize();
+    espeak_Terminate();
+}
 
-    speak_audio("pina_shell: expected argument to cd");
-    
-    // jnc fim
+#endif
 
-  } else {
-    if (chdir(args[1]) != 0) {
-      perror("pina_shell");
+
+// Lookahead backend: the text is split in lines and sentences, a pool of
+// worker threads synthesizes the next few of them with espeak-ng --stdout
+// while the current one plays, and a player thread feeds the audio, in
+// order, to one long running player process, so that there is no gap
+// between utterances. PINA_TTS_WORKERS sets the number of workers and
+// PINA_TTS_PLAYER the player command, that reads 16 bit mono PCM at the
+// sample rate of the voice.
+
+#define TTS_POOL_MAX_WORKERS    8
+#define TTS_POOL_LOOKAHEAD      4     // Segments synthesized ahead of playback.
+#define TTS_POOL_SEGMENT_MAX    300   // Longer segments are cut at a space.
+#define TTS_POOL_DEFAULT_PLAYER "aplay -q -t raw -f S16_LE -c 1 -r %u"  // The voice rate.
+
+typedef struct PoolSegment {
+    char               *text;
+    long                seq;        // Order of playback.
+    int                 state;      // 0 waiting, 1 synthesizing, 2 ready.
+    int                 orphan;     // Cancelled while being synthesized.
+    pid_t               pid;        // The espeak-ng synthesizing it.
+    DynBuffer           pcm;        // The WAV written by espeak-ng.
+    struct PoolSegment *next;
+} PoolSegment;
+
+pthread_mutex_t tts_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  tts_pool_work  = PTHREAD_COND_INITIALIZER;  // New segment or window.
+pthread_cond_t  tts_pool_done  = PTHREAD_COND_INITIALIZER;  // A segment was played.
+
+PoolSegment *tts_pool_head          = NULL;  // Next to play.
+PoolSegment *tts_pool_tail          = NULL;
+long         tts_pool_next_seq      = 0;
+int          tts_pool_playing       = 0;
+long         tts_pool_generation    = 0;     // Incremented by cancel.
+int          tts_pool_stop          = 0;
+
+pthread_t    tts_pool_workers[TTS_POOL_MAX_WORKERS];
+int          tts_pool_num_workers   = 0;
+pthread_t    tts_pool_player_thread;
+pid_t        tts_pool_player_pid    = 0;
+int          tts_pool_player_fd     = -1;
+int          tts_pool_player_killed = 0;     // By cancel, to drop its audio.
+unsigned     tts_pool_player_rate   = 0;     // Sample rate the player was started at.
+
+// Spawns cmd_args with its stdin or stdout ( target_fd ) on a pipe, whose
+// other end is returned in *fd. posix_spawn is safe in a threaded process.
+pid_t tts_spawn_with_pipe(char **cmd_args, int target_fd, int *fd, int own_group) {
+    int pipe_fd[2];
+    if (pipe2(pipe_fd, O_CLOEXEC) == -1) {
+        return -1;
+    }
+    int child_end = (target_fd == STDIN_FILENO) ? 0 : 1;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipe_fd[child_end], target_fd);
+
+    // The children get the default signal mask, the threads block all.
+    posix_spawnattr_t attr;
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &no_signals);
+    if (own_group) {
+        posix_spawnattr_setpgroup(&attr, 0);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+    } else {
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
     }
-  }
-  return 1;
-}
 
+    pid_t pid;
+    int error = posix_spawnp(&pid, cmd_args[0], &actions, &attr, cmd_args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
 
-/// @brief Builtin command: print help.
-/// @param args List of args.  Not examined.
-/// @return Always returns 1, to continue executing.
-int lsh_help(char **args)
-{
-  int i;
-  printf("Joao Carvalho - pina_shell\n");
-  printf("Stephen Brennan's LSH\n");
-  printf("Type program names and arguments, and hit enter.\n");
-  printf("The following are built in:\n");
+    close(pipe_fd[child_end]);
+    if (error != 0) {
+        close(pipe_fd[1 - child_end]);
+        return -1;
+    }
+    *fd = pipe_fd[1 - child_end];
+    return pid;
+}
 
-  for (i = 0; i < lsh_num_builtins(); i++) {
-    printf("  %s\n", builtin_str[i]);
-  }
+// 1 if the program of the command ( its first word ) is found, in PATH like
+// the typed commands.
+int tts_command_found(const char *command) {
+    char *program = strndup(command, strcspn(command, " "));
+    char *suggestion = NULL;
+    int found = program != NULL && lookup_command(program, &suggestion);
+    free(suggestion);
+    free(program);
+    return found;
+}
 
-  printf("Use the man command for information on other programs.\n");
-  return 1;
+void tts_pool_free_segment(PoolSegment *seg) {
+    free(seg->text);
+    dyn_buffer_free(&seg->pcm);
+    free(seg);
 }
 
-/// @brief Builtin command: exit.
-/// @param args List of args.  Not examined.
-/// @return Always returns 0, to terminate execution.
-int lsh_exit(char **args)
-{
-  return 0;
+// The first waiting segment inside the lookahead window, or NULL.
+PoolSegment *tts_pool_next_to_synthesize(void) {
+    long window_end = (tts_pool_head ? tts_pool_head->seq : tts_pool_next_seq) + TTS_POOL_LOOKAHEAD;
+    for (PoolSegment *seg = tts_pool_head; seg != NULL && seg->seq < window_end; seg = seg->next) {
+        if (seg->state == 0) {
+            return seg;
+        }
+    }
+    return NULL;
 }
 
-// jnc begin
+void *tts_pool_worker(void *arg) {
+    pthread_mutex_lock(&tts_pool_mutex);
+    while (!tts_pool_stop) {
+        PoolSegment *seg = tts_pool_next_to_synthesize();
+        if (seg == NULL) {
+            pthread_cond_wait(&tts_pool_work, &tts_pool_mutex);
+            continue;
+        }
 
-void replace_newline_space_tab_with_char_name(const char *src, char *dest, char *read_context_txt) {
-    // Copy the context text to the destination (std out: \n or std err: \n).
-    strcat(dest, read_context_txt);
-
-    while (*src) {
-        if (*src == '\n') {
-            strcat(dest, " newline ");
-            src += 1;  // Skip both characters '\n'
-        } if (*src == '\t') {
-            strcat(dest, " tab ");
-            src += 2;  // Skip both characters '\t'
-        } if (*src == ' ' ) {
-            strcat(dest, " space ");
-            src += 1;  // Skip both characters ' '
+        char rate[16];
+        char *to_free;
+        const char *args[8];
+        tts_espeak_ng_args(seg->text, "--stdout", args, rate, &to_free);
+
+        int fd;
+        seg->state = 1;
+        seg->pid   = tts_spawn_with_pipe((char **) args, STDOUT_FILENO, &fd, 0);
+        free(to_free);
+        pid_t pid  = seg->pid;
+        pthread_mutex_unlock(&tts_pool_mutex);
+
+        DynBuffer pcm;
+        dyn_buffer_init(&pcm);
+        if (pid > 0) {
+            char buffer[1024 * 16];
+            ssize_t n;
+            while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+                if (n < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    break;
+                }
+                dyn_buffer_append(&pcm, buffer, n);
+            }
+            close(fd);
+            // Until it is reaped the pid can't be reused, so cancel only
+            // kills it while it is still in the segment.
+            pthread_mutex_lock(&tts_pool_mutex);
+            seg->pid = 0;
+            pthread_mutex_unlock(&tts_pool_mutex);
+            int status;
+            while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+            }
+        }
+
+        pthread_mutex_lock(&tts_pool_mutex);
+        if (seg->orphan) {
+            dyn_buffer_free(&pcm);
+            tts_pool_free_segment(seg);
         } else {
-            strncat(dest, src, 1);
-            src++;
+            seg->pcm   = pcm;
+            seg->state = 2;
+            seg->pid   = 0;
+            pthread_cond_broadcast(&tts_pool_work);
         }
     }
+    pthread_mutex_unlock(&tts_pool_mutex);
+    return arg;
 }
 
-char * join_args_with_space( char **args ) {
-    // Step 1: Calculate total length required
-    size_t total_len = 0;
-    for (int i = 0; args[i] != NULL; i++) {
-        total_len += strlen(args[i]) + 1;  // +1 for space or null terminator
+// Closes the player and reaps it. Only the player thread calls it.
+void tts_pool_stop_player(void) {
+    pthread_mutex_lock(&tts_pool_mutex);
+    pid_t pid = tts_pool_player_pid;
+    tts_pool_player_pid    = 0;
+    tts_pool_player_killed = 0;
+    pthread_mutex_unlock(&tts_pool_mutex);
+
+    if (tts_pool_player_fd >= 0) {
+        close(tts_pool_player_fd);
+        tts_pool_player_fd = -1;
     }
-    if (total_len == 0) return NULL;
+    if (pid > 0) {
+        kill(pid, SIGKILL);
+        while (waitpid(pid, NULL, 0) == -1 && errno == EINTR) {
+        }
+    }
+}
 
-    // Step 2: Allocate memory
-    char *result = malloc(total_len);
-    if (!result) {
+int tts_pool_cancelled(long generation) {
+    pthread_mutex_lock(&tts_pool_mutex);
+    int cancelled = (generation != tts_pool_generation);
+    pthread_mutex_unlock(&tts_pool_mutex);
+    return cancelled;
+}
+
+// Writes the PCM to the player, starting it if needed. Stops early if the
+// speech is cancelled. Called without the mutex.
+void tts_pool_play(DynBuffer *wav, long generation) {
+    if (wav->len <= TTS_WAV_HEADER_SIZE) {
+        return;
+    }
+
+    // The sample rate of the voice, in the header that espeak-ng wrote.
+    const unsigned char *header = (const unsigned char *) wav->data;
+    unsigned rate = header[24] | header[25] << 8 | header[26] << 16 | (unsigned) header[27] << 24;
+    if (rate == 0) {
+        rate = 22050;
+    }
+
+    pthread_mutex_lock(&tts_pool_mutex);
+    int killed = tts_pool_player_killed;
+    pthread_mutex_unlock(&tts_pool_mutex);
+    if (killed || (tts_pool_player_fd >= 0 && rate != tts_pool_player_rate)) {
+        tts_pool_stop_player();
+    }
+
+    if (tts_pool_player_fd < 0) {
+        const char *player = getenv("PINA_TTS_PLAYER");
+        char command[128];
+        snprintf(command, sizeof(command), TTS_POOL_DEFAULT_PLAYER, rate);
+        char *args[] = { "/bin/sh", "-c", (char *) (player ? player : command), NULL };
+        int fd;
+        pid_t pid = tts_spawn_with_pipe(args, STDIN_FILENO, &fd, 0);
+        if (pid <= 0) {
+            return;
+        }
+        pthread_mutex_lock(&tts_pool_mutex);
+        tts_pool_player_pid  = pid;
+        tts_pool_player_fd   = fd;
+        tts_pool_player_rate = rate;
+        pthread_mutex_unlock(&tts_pool_mutex);
+    }
+
+    const char *data = wav->data + TTS_WAV_HEADER_SIZE;
+    size_t left = wav->len - TTS_WAV_HEADER_SIZE;
+    while (left > 0 && !tts_pool_cancelled(generation)) {
+        ssize_t n = write(tts_pool_player_fd, data, left < 4096 ? left : 4096);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        data += n;
+        left -= n;
+    }
+
+    if (left > 0) {
+        // Cancelled or the player died: a new player drops what was buffered.
+        tts_pool_stop_player();
+    }
+}
+
+void *tts_pool_player(void *arg) {
+    pthread_mutex_lock(&tts_pool_mutex);
+    while (!tts_pool_stop) {
+        PoolSegment *seg = tts_pool_head;
+        if (seg == NULL || seg->state != 2) {
+            pthread_cond_wait(&tts_pool_work, &tts_pool_mutex);
+            continue;
+        }
+
+        // Removing it moves the lookahead window forward.
+        tts_pool_head = seg->next;
+        if (tts_pool_head == NULL) {
+            tts_pool_tail = NULL;
+        }
+        tts_pool_playing = 1;
+        long generation = tts_pool_generation;
+        pthread_cond_broadcast(&tts_pool_work);
+        pthread_mutex_unlock(&tts_pool_mutex);
+
+        tts_pool_play(&seg->pcm, generation);
+        tts_pool_free_segment(seg);
+
+        pthread_mutex_lock(&tts_pool_mutex);
+        tts_pool_playing = 0;
+        pthread_cond_broadcast(&tts_pool_done);
+    }
+    pthread_mutex_unlock(&tts_pool_mutex);
+    return arg;
+}
+
+int tts_pool_open(void) {
+    // The player is needed, check that its program can be found.
+    const char *player = getenv("PINA_TTS_PLAYER");
+    if (!tts_command_found(player ? player : TTS_POOL_DEFAULT_PLAYER)) {
+        return -1;
+    }
+
+    const char *workers = getenv("PINA_TTS_WORKERS");
+    tts_pool_num_workers = workers ? atoi(workers) : 0;
+    if (tts_pool_num_workers <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        tts_pool_num_workers = cores > 1 ? (cores - 1 < 3 ? cores - 1 : 3) : 1;
+    }
+    if (tts_pool_num_workers > TTS_POOL_MAX_WORKERS) {
+        tts_pool_num_workers = TTS_POOL_MAX_WORKERS;
+    }
+
+    // The threads block all signals, they are for the event loop signalfd.
+    sigset_t all_signals, old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+    for (int i = 0; i < tts_pool_num_workers; i++) {
+        pthread_create(&tts_pool_workers[i], NULL, tts_pool_worker, NULL);
+    }
+    pthread_create(&tts_pool_player_thread, NULL, tts_pool_player, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    return 0;
+}
+
+void tts_pool_add_segment(const char *text, size_t len) {
+    while (len > 0 && text[0] == ' ') {
+        text++;
+        len--;
+    }
+    if (len == 0) {
+        return;
+    }
+
+    PoolSegment *seg = calloc(1, sizeof(PoolSegment));
+    if (!seg || !(seg->text = strndup(text, len))) {
+        fprintf(stderr, "pina_shell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    dyn_buffer_init(&seg->pcm);
+    seg->seq = tts_pool_next_seq++;
+    if (tts_pool_tail != NULL) {
+        tts_pool_tail->next = seg;
+    } else {
+        tts_pool_head = seg;
+    }
+    tts_pool_tail = seg;
+}
+
+void tts_pool_speak(const char *text) {
+    pthread_mutex_lock(&tts_pool_mutex);
+
+    // Segments end after " newline ", a sentence end or TTS_POOL_SEGMENT_MAX.
+    const char *start = text;
+    const char *p     = text;
+    const char *last_space = NULL;
+    while (*p) {
+        size_t end = 0;
+        if (strncmp(p, " newline ", 9) == 0) {
+            end = 9;
+        } else if ((*p == '.' || *p == '!' || *p == '?' || *p == '\n') && (p[1] == ' ' || p[1] == '\n')) {
+            end = 2;
+        } else if (p - start >= TTS_POOL_SEGMENT_MAX && last_space != NULL) {
+            p = last_space;
+            end = 1;
+        }
+
+        if (end > 0) {
+            tts_pool_add_segment(start, p + end - start);
+            p += end;
+            start = p;
+            last_space = NULL;
+            continue;
+        }
+        if (*p == ' ') {
+            last_space = p;
+        }
+        p++;
+    }
+    tts_pool_add_segment(start, p - start);
+
+    pthread_cond_broadcast(&tts_pool_work);
+    pthread_mutex_unlock(&tts_pool_mutex);
+}
+
+void tts_pool_cancel(void) {
+    pthread_mutex_lock(&tts_pool_mutex);
+    tts_pool_generation++;
+
+    PoolSegment *seg = tts_pool_head;
+    while (seg != NULL) {
+        PoolSegment *next = seg->next;
+        if (seg->state == 1) {
+            // Its worker frees it.
+            seg->orphan = 1;
+            if (seg->pid > 0) {
+                kill(seg->pid, SIGKILL);
+            }
+        } else {
+            tts_pool_free_segment(seg);
+        }
+        seg = next;
+    }
+    tts_pool_head = tts_pool_tail = NULL;
+
+    // Silences the audio already written to the player.
+    if (tts_pool_player_pid > 0) {
+        kill(tts_pool_player_pid, SIGKILL);
+        tts_pool_player_killed = 1;
+    }
+    pthread_cond_broadcast(&tts_pool_work);
+    pthread_mutex_unlock(&tts_pool_mutex);
+}
+
+void tts_pool_flush(void) {
+    pthread_mutex_lock(&tts_pool_mutex);
+    while (tts_pool_head != NULL || tts_pool_playing) {
+        pthread_cond_wait(&tts_pool_done, &tts_pool_mutex);
+    }
+    pthread_mutex_unlock(&tts_pool_mutex);
+}
+
+int tts_pool_busy(void) {
+    pthread_mutex_lock(&tts_pool_mutex);
+    // Until the last segment was played.
+    int busy = tts_pool_head != NULL || tts_pool_playing;
+    pthread_mutex_unlock(&tts_pool_mutex);
+    return busy;
+}
+
+void tts_pool_set_rate(int words_per_minute) {
+    tts_rate = words_per_minute;
+}
+
+void tts_pool_close(void) {
+    tts_pool_flush();
+
+    pthread_mutex_lock(&tts_pool_mutex);
+    tts_pool_stop = 1;
+    pthread_cond_broadcast(&tts_pool_work);
+    pthread_mutex_unlock(&tts_pool_mutex);
+    for (int i = 0; i < tts_pool_num_workers; i++) {
+        pthread_join(tts_pool_workers[i], NULL);
+    }
+    pthread_join(tts_pool_player_thread, NULL);
+
+    // Lets the player end the audio it has.
+    if (tts_pool_player_fd >= 0) {
+        close(tts_pool_player_fd);
+        tts_pool_player_fd = -1;
+        while (tts_pool_player_pid > 0 && waitpid(tts_pool_player_pid, NULL, 0) == -1 && errno == EINTR) {
+        }
+    }
+}
+
+
+// The wav and null backends are done with an utterance when speak()
+// returns.
+int tts_never_busy(void) {
+    return 0;
+}
+
+
+// WAV file backend: 16 bit mono PCM, the sizes in the header are written
+// on flush and close.
+
+FILE    *tts_wav_file        = NULL;
+uint32_t tts_wav_data_bytes  = 0;
+int      tts_wav_sample_rate = 22050;   // The espeak-ng voices rate.
+
+void tts_wav_put_u32(unsigned char *p, uint32_t v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+void tts_wav_write_header(void) {
+    unsigned char h[TTS_WAV_HEADER_SIZE] = "RIFF\0\0\0\0WAVEfmt \x10\0\0\0\x01\0\x01\0"
+                                           "\0\0\0\0\0\0\0\0\x02\0\x10\0data";
+    tts_wav_put_u32(h + 4,  36 + tts_wav_data_bytes);
+    tts_wav_put_u32(h + 24, tts_wav_sample_rate);
+    tts_wav_put_u32(h + 28, tts_wav_sample_rate * 2);
+    tts_wav_put_u32(h + 40, tts_wav_data_bytes);
+
+    long pos = ftell(tts_wav_file);
+    fseek(tts_wav_file, 0, SEEK_SET);
+    fwrite(h, 1, sizeof(h), tts_wav_file);
+    if (pos > TTS_WAV_HEADER_SIZE) {
+        fseek(tts_wav_file, pos, SEEK_SET);
+    }
+}
+
+void tts_wav_append(const void *samples, size_t bytes) {
+    fwrite(samples, 1, bytes, tts_wav_file);
+    tts_wav_data_bytes += bytes;
+}
+
+#ifdef PINA_HAVE_LIBESPEAK_NG
+int tts_wav_synth_callback(short *wav, int num_samples, espeak_EVENT *events) {
+    if (wav != NULL && num_samples > 0) {
+        tts_wav_append(wav, num_samples * sizeof(short));
+    }
+    return 0;
+}
+#endif
+
+int tts_wav_open(void) {
+    const char *path = getenv("PINA_TTS_WAV");
+    tts_wav_file = fopen(path ? path : "pina_shell.wav", "w+b");
+    if (tts_wav_file == NULL) {
+        perror("pina_shell: wav");
+        return -1;
+    }
+#ifdef PINA_HAVE_LIBESPEAK_NG
+    int sample_rate = espeak_Initialize(AUDIO_OUTPUT_SYNCHRONOUS, 0, NULL, 0);
+    if (sample_rate > 0) {
+        tts_wav_sample_rate = sample_rate;
+    }
+    espeak_SetParameter(espeakPUNCTUATION, espeakPUNCT_ALL, 0);
+    espeak_SetSynthCallback(tts_wav_synth_callback);
+#endif
+    tts_wav_write_header();
+    return 0;
+}
+
+void tts_wav_speak(const char *text) {
+#ifdef PINA_HAVE_LIBESPEAK_NG
+    espeak_Synth(text, strlen(text) + 1, 0, POS_CHARACTER, 0, espeakCHARS_AUTO, NULL, NULL);
+#else
+    // Reads the WAV that espeak-ng writes to its stdout, without its header.
+    int pipe_fd[2];
+    if (pipe(pipe_fd) == -1) {
+        perror("pipe");
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(pipe_fd[0]);
+        dup2(pipe_fd[1], STDOUT_FILENO);
+        close(pipe_fd[1]);
+        tts_exec_espeak_ng(text, "--stdout");
+    }
+    close(pipe_fd[1]);
+
+    char buffer[1024 * 16];
+    size_t header_left = TTS_WAV_HEADER_SIZE;
+    ssize_t bytes_read;
+    while ((bytes_read = read(pipe_fd[0], buffer, sizeof(buffer))) != 0) {
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        size_t skip = (size_t) bytes_read < header_left ? (size_t) bytes_read : header_left;
+        header_left -= skip;
+        tts_wav_append(buffer + skip, bytes_read - skip);
+    }
+    close(pipe_fd[0]);
+
+    int status;
+    if (pid > 0) {
+        while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+        }
+    }
+#endif
+}
+
+void tts_wav_cancel(void) {
+}
+
+void tts_wav_flush(void) {
+    tts_wav_write_header();
+    fflush(tts_wav_file);
+}
+
+void tts_wav_set_rate(int words_per_minute) {
+    tts_rate = words_per_minute;
+#ifdef PINA_HAVE_LIBESPEAK_NG
+    if (words_per_minute > 0) {
+        espeak_SetParameter(espeakRATE, words_per_minute, 0);
+    }
+#endif
+}
+
+void tts_wav_close(void) {
+#ifdef PINA_HAVE_LIBESPEAK_NG
+    espeak_Terminate();
+#endif
+    tts_wav_write_header();
+    fclose(tts_wav_file);
+    tts_wav_file = NULL;
+}
+
+
+// Null backend: records when each utterance was issued and its size.
+
+FILE  *tts_null_log        = NULL;
+double tts_null_start      = 0.0;
+long   tts_null_utterances = 0;
+size_t tts_null_bytes      = 0;
+
+int tts_null_open(void) {
+    const char *path = getenv("PINA_TTS_LOG");
+    if (path != NULL) {
+        tts_null_log = fopen(path, "w");
+        if (tts_null_log == NULL) {
+            perror("pina_shell: PINA_TTS_LOG");
+        }
+    }
+    tts_null_start = monotonic_seconds();
+    return 0;
+}
+
+void tts_null_speak(const char *text) {
+    size_t len = strlen(text);
+    tts_null_utterances++;
+    tts_null_bytes += len;
+    if (tts_null_log != NULL) {
+        int shown = (int) strcspn(text, "\n");
+        fprintf(tts_null_log, "%.6f speak %zu %.*s\n",
+                monotonic_seconds() - tts_null_start, len, shown < 60 ? shown : 60, text);
+    }
+}
+
+void tts_null_event(const char *event) {
+    if (tts_null_log != NULL) {
+        fprintf(tts_null_log, "%.6f %s\n", monotonic_seconds() - tts_null_start, event);
+    }
+}
+
+void tts_null_cancel(void) {
+    tts_null_event("cancel");
+}
+
+void tts_null_flush(void) {
+    tts_null_event("flush");
+}
+
+void tts_null_set_rate(int words_per_minute) {
+    tts_rate = words_per_minute;
+}
+
+void tts_null_close(void) {
+    double elapsed = monotonic_seconds() - tts_null_start;
+    fprintf(stderr, "pina_shell: null speech: %ld utterances, %zu bytes in %.3f s\n",
+            tts_null_utterances, tts_null_bytes, elapsed);
+    if (tts_null_log != NULL) {
+        fclose(tts_null_log);
+        tts_null_log = NULL;
+    }
+}
+
+
+// Unix socket backend, speaking the SSIP protocol of speech-dispatcher,
+// with the priority of each utterance and its END and CANCEL notifications,
+// that tell when the daemon is done with it. The daemon backend speaks the
+// same to the pina_shell speech daemon, plus "SET self FOCUS on" when a key
+// is pressed in the shell, with which the daemon arbitrates between the
+// shells.
+
+int       tts_socket_fd = -1;
+DynBuffer tts_socket_input;          // Received, not yet a whole line.
+
+// 1 when the daemon sends the notifications, and the id of the message it
+// is speaking, 0 when it is done with it.
+int  tts_socket_notified   = 0;
+long tts_socket_message_id = 0;
+long tts_socket_event_id   = 0;      // Of the event being received.
+long tts_socket_reply_id   = 0;      // Of the last "225-ID" reply line.
+
+// 1 when the peer is the pina_shell speech daemon, that knows FOCUS.
+int tts_socket_arbitrated = 0;
+
+// Priority of the utterance that speech_pump() hands to the backend, and
+// the last one sent to the daemon.
+int speech_utterance_priority = PINA_SPEECH_PROMPT;
+int tts_socket_priority       = -1;
+
+// SSIP names of the priorities, PINA_SPEECH_ECHO ... PINA_SPEECH_NARRATION,
+// one each so that the speech daemon gets them back.
+const char *tts_ssip_priorities[PINA_SPEECH_PRIORITIES] = {
+    "important", "message", "text", "notification"
+};
+
+// Reads one line, without its CRLF.
+// Returns 1, 0 if wait is 0 and no whole line was received, or -1 on error.
+int tts_socket_read_line(char *line, size_t size, int wait) {
+    while (1) {
+        char *end = tts_socket_input.len > 0
+                    ? memchr(tts_socket_input.data, '\n', tts_socket_input.len) : NULL;
+        if (end != NULL) {
+            size_t len = end - tts_socket_input.data;
+            size_t line_len = (len > 0 && end[-1] == '\r') ? len - 1 : len;
+            if (line_len > size - 1) {
+                line_len = size - 1;
+            }
+            memcpy(line, tts_socket_input.data, line_len);
+            line[line_len] = '\0';
+            tts_socket_input.len -= len + 1;
+            memmove(tts_socket_input.data, end + 1, tts_socket_input.len);
+            return 1;
+        }
+
+        char buffer[1024];
+        ssize_t n = recv(tts_socket_fd, buffer, sizeof(buffer), wait ? 0 : MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        dyn_buffer_append(&tts_socket_input, buffer, n);
+    }
+}
+
+// A line of an event, "7NN-MSG_ID", "7NN-CLIENT_ID" and "7NN NAME": the
+// END ( 702 ) or CANCELED ( 703 ) of the message being spoken ends it.
+void tts_socket_event(const char *line) {
+    if (line[3] == '-') {
+        if (tts_socket_event_id < 0) {
+            tts_socket_event_id = atol(line + 4);
+        }
+        return;
+    }
+    int code = atoi(line);
+    if ((code == 702 || code == 703) && tts_socket_event_id == tts_socket_message_id) {
+        tts_socket_message_id = 0;
+    }
+    tts_socket_event_id = -1;
+}
+
+// Reads a reply, that may have many "NNN-..." lines before the "NNN ..." one,
+// and handles the events received before it.
+// Returns the reply code, or -1 on error.
+int tts_socket_reply(void) {
+    char line[512];
+
+    while (tts_socket_read_line(line, sizeof(line), 1) == 1) {
+        if (strlen(line) < 4) {
+            continue;
+        }
+        if (line[0] == '7') {
+            tts_socket_event(line);
+        } else if (line[3] == '-') {
+            tts_socket_reply_id = atol(line + 4);
+        } else if (line[3] == ' ') {
+            return atoi(line);
+        }
+    }
+    return -1;
+}
+
+// Handles the events received, and waits for them if wait is 1, until the
+// daemon is done with the message.
+void tts_socket_poll_events(int wait) {
+    char line[512];
+    while (tts_socket_message_id != 0) {
+        int got = tts_socket_read_line(line, sizeof(line), wait);
+        if (got == 0) {
+            return;
+        }
+        if (got < 0) {
+            // The daemon went away, with the message.
+            tts_socket_message_id = 0;
+            return;
+        }
+        if (strlen(line) >= 4 && line[0] == '7') {
+            tts_socket_event(line);
+        }
+    }
+}
+
+int tts_socket_send(const char *data, size_t len) {
+    while (len > 0) {
+        // Without SIGPIPE if the daemon went away.
+        ssize_t n = send(tts_socket_fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len  -= n;
+    }
+    return 0;
+}
+
+// Sends one command line and returns the reply code, or -1 on error.
+int tts_socket_command(const char *command) {
+    if (tts_socket_fd < 0
+        || tts_socket_send(command, strlen(command)) == -1
+        || tts_socket_send("\r\n", 2) == -1) {
+        return -1;
+    }
+    return tts_socket_reply();
+}
+
+///  @brief Connects to the SSIP daemon listening on the Unix socket path.
+///  @return 0, or -1 if nothing listens there.
+int tts_socket_connect(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    // In tmux, the daemon names the shell after its pane.
+    char command[128];
+    const char *pane = getenv("TMUX_PANE");
+    if (pane != NULL && pane[0] == '%' && isdigit((unsigned char) pane[1])) {
+        snprintf(command, sizeof(command), "SET self CLIENT_NAME user:pina_shell:pane%.16s", pane + 1);
+    } else {
+        snprintf(command, sizeof(command), "SET self CLIENT_NAME user:pina_shell:main");
+    }
+
+    dyn_buffer_init(&tts_socket_input);
+    tts_socket_message_id = 0;
+    tts_socket_event_id   = -1;
+    tts_socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (tts_socket_fd < 0) {
+        return -1;
+    }
+    if (connect(tts_socket_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+        || tts_socket_command(command) / 100 != 2) {
+        close(tts_socket_fd);
+        tts_socket_fd = -1;
+        dyn_buffer_free(&tts_socket_input);
+        return -1;
+    }
+    tts_socket_command("SET self PUNCTUATION all");
+    // Without them, the daemon queues the utterances as they come.
+    tts_socket_notified = tts_socket_command("SET self NOTIFICATION end on") / 100 == 2
+                          && tts_socket_command("SET self NOTIFICATION cancel on") / 100 == 2;
+    // speech-dispatcher answers with an error, a new shell takes the focus.
+    tts_socket_arbitrated = tts_socket_command("SET self FOCUS on") / 100 == 2;
+    tts_socket_priority   = -1;
+    return 0;
+}
+
+int tts_socket_open(void) {
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    const char *socket_path = getenv("PINA_TTS_SOCKET");
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (socket_path != NULL) {
+        snprintf(path, sizeof(path), "%s", socket_path);
+    } else if (runtime_dir != NULL) {
+        snprintf(path, sizeof(path), "%s/speech-dispatcher/speechd.sock", runtime_dir);
+    } else {
+        return -1;
+    }
+    return tts_socket_connect(path);
+}
+
+///  @brief The Unix socket of the pina_shell speech daemon: PINA_TTS_SOCKET,
+///         or pina_shell/speech.sock in $XDG_RUNTIME_DIR, or in /tmp/pina_shell-UID.
+///         The keys and the outputs go through it, so its directory must
+///         be a directory of the user that only the user can open: in /tmp
+///         another user could have made it first.
+///  @param create_dir 1 to create its directory, only readable by the user.
+///  @return 0, or -1 if the directory isn't private to the user.
+int tts_daemon_socket_path(char *path, size_t size, int create_dir) {
+    const char *socket_path = getenv("PINA_TTS_SOCKET");
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (socket_path != NULL) {
+        snprintf(path, size, "%s", socket_path);
+        return 0;
+    }
+    if (runtime_dir != NULL && runtime_dir[0] == '/') {
+        snprintf(path, size, "%s/pina_shell", runtime_dir);
+    } else {
+        snprintf(path, size, "/tmp/pina_shell-%u", (unsigned int) getuid());
+    }
+    if (create_dir) {
+        mkdir(path, 0700);
+    }
+
+    struct stat st;
+    if (lstat(path, &st) == -1) {
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 0777) != 0700) {
+        fprintf(stderr, "pina_shell: %s isn't a directory that only this user can open, "
+                "the speech daemon isn't used\n", path);
+        return -1;
+    }
+    size_t len = strlen(path);
+    snprintf(path + len, size - len, "/speech.sock");
+    return 0;
+}
+
+// Starts pina_shell --speech-daemon, detached from the terminal and from
+// the session of the shell, so that the other shells can share it.
+void tts_daemon_spawn(void) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        setsid();
+        if (fork() != 0) {
+            _exit(0);
+        }
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        int null_fd = open("/dev/null", O_RDWR);
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        execl("/proc/self/exe", "pina_shell", "--speech-daemon", (char *) NULL);
+        _exit(127);
+    } else if (pid > 0) {
+        while (waitpid(pid, NULL, 0) == -1 && errno == EINTR) {
+        }
+    }
+}
+
+int tts_daemon_open(void) {
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    if (tts_daemon_socket_path(path, sizeof(path), 1) != 0) {
+        return -1;
+    }
+    if (tts_socket_connect(path) == 0) {
+        return 0;
+    }
+
+    // The first shell starts the daemon, and waits for it to listen.
+    tts_daemon_spawn();
+    for (int i = 0; i < 200; i++) {
+        struct timespec ts = { 0, 10 * 1000 * 1000 };
+        nanosleep(&ts, NULL);
+        if (tts_socket_connect(path) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+///  @brief Tells the speech daemon that the user is at this shell.
+void tts_socket_focus(void) {
+    if (tts_socket_arbitrated && tts_socket_fd >= 0) {
+        tts_socket_command("SET self FOCUS on");
+    }
+}
+
+void tts_socket_speak(const char *text) {
+    if (speech_utterance_priority != tts_socket_priority) {
+        char command[64];
+        snprintf(command, sizeof(command), "SET self PRIORITY %s",
+                 tts_ssip_priorities[speech_utterance_priority]);
+        tts_socket_command(command);
+        tts_socket_priority = speech_utterance_priority;
+    }
+    if (tts_socket_command("SPEAK") != 230) {
+        return;
+    }
+
+    // The text goes in CRLF lines, a line starting with '.' gets one more,
+    // and a line with a single '.' ends it.
+    DynBuffer data;
+    dyn_buffer_init(&data);
+    int line_start = 1;
+    for (const char *p = text; *p; p++) {
+        if (line_start && *p == '.') {
+            dyn_buffer_append(&data, ".", 1);
+        }
+        line_start = (*p == '\n');
+        if (*p == '\n') {
+            dyn_buffer_append(&data, "\r\n", 2);
+        } else {
+            dyn_buffer_append(&data, p, 1);
+        }
+    }
+    dyn_buffer_append(&data, "\r\n.\r\n", 5);
+
+    if (tts_socket_send(data.data, data.len) == 0 && tts_socket_reply() == 225
+        && tts_socket_notified) {
+        tts_socket_message_id = tts_socket_reply_id;
+    }
+    dyn_buffer_free(&data);
+}
+
+void tts_socket_cancel(void) {
+    tts_socket_command("CANCEL self");
+    tts_socket_message_id = 0;
+}
+
+void tts_socket_flush(void) {
+    tts_socket_poll_events(1);
+}
+
+int tts_socket_busy(void) {
+    tts_socket_poll_events(0);
+    return tts_socket_message_id != 0;
+}
+
+void tts_socket_set_rate(int words_per_minute) {
+    tts_rate = words_per_minute;
+    if (words_per_minute > 0) {
+        // SSIP rates go from -100 to 100, 0 being about 175 words per minute.
+        int rate = (words_per_minute - 175) * 100 / 275;
+        rate = rate < -100 ? -100 : (rate > 100 ? 100 : rate);
+        char command[64];
+        snprintf(command, sizeof(command), "SET self RATE %d", rate);
+        tts_socket_command(command);
+    }
+}
+
+void tts_socket_close(void) {
+    if (tts_socket_fd >= 0) {
+        tts_socket_command("QUIT");
+        close(tts_socket_fd);
+        tts_socket_fd = -1;
+        dyn_buffer_free(&tts_socket_input);
+    }
+    tts_socket_arbitrated = 0;
+    tts_socket_message_id = 0;
+}
+
+
+/// List of speech backends, the first one is the default.
+SpeechBackend speech_backends[] = {
+  { "espeak-ng", tts_espeak_open, tts_espeak_speak, tts_espeak_cancel,
+    tts_espeak_flush, tts_espeak_busy, tts_espeak_set_rate, tts_espeak_close },
+#ifdef PINA_HAVE_LIBESPEAK_NG
+  { "libespeak-ng", tts_libespeak_open, tts_libespeak_speak, tts_libespeak_cancel,
+    tts_libespeak_flush, tts_libespeak_busy, tts_libespeak_set_rate, tts_libespeak_close },
+#endif
+  { "lookahead", tts_pool_open, tts_pool_speak, tts_pool_cancel,
+    tts_pool_flush, tts_pool_busy, tts_pool_set_rate, tts_pool_close },
+  { "wav", tts_wav_open, tts_wav_speak, tts_wav_cancel,
+    tts_wav_flush, tts_never_busy, tts_wav_set_rate, tts_wav_close },
+  { "null", tts_null_open, tts_null_speak, tts_null_cancel,
+    tts_null_flush, tts_never_busy, tts_null_set_rate, tts_null_close },
+  { "socket", tts_socket_open, tts_socket_speak, tts_socket_cancel,
+    tts_socket_flush, tts_socket_busy, tts_socket_set_rate, tts_socket_close },
+  { "daemon", tts_daemon_open, tts_socket_speak, tts_socket_cancel,
+    tts_socket_flush, tts_socket_busy, tts_socket_set_rate, tts_socket_close }
+};
+
+int speech_num_backends() {
+  return sizeof(speech_backends) / sizeof(SpeechBackend);
+}
+
+// The backend in use, and the process that opened it.
+SpeechBackend *speech = NULL;
+pid_t speech_owner_pid = 0;
+
+///  @brief Opens the speech backend with the given name, or the default one
+///         if the name is NULL or that backend can't be opened.
+void speech_open(const char *name) {
+    speech = &speech_backends[0];
+    for (int i = 0; name != NULL && i < speech_num_backends(); i++) {
+        if (strcmp(name, speech_backends[i].name) == 0) {
+            speech = &speech_backends[i];
+        }
+    }
+    if (name != NULL && strcmp(name, speech->name) != 0) {
+        fprintf(stderr, "pina_shell: unknown speech backend %s, using %s\n", name, speech->name);
+    }
+
+    if (speech->open() == -1) {
+        fprintf(stderr, "pina_shell: can't open speech backend %s, using %s\n",
+                speech->name, speech_backends[0].name);
+        speech = &speech_backends[0];
+        speech->open();
+    }
+    speech_owner_pid = getpid();
+
+    const char *rate = getenv("PINA_TTS_RATE");
+    if (rate != NULL && atoi(rate) > 0) {
+        speech->set_rate(atoi(rate));
+    }
+}
+
+// Utterances waiting for the backend, one queue per priority, each in the
+// order they were issued. The event loop calls speech_pump() when the
+// backend may have become free, and it takes the most important first:
+//
+//   PINA_SPEECH_ECHO       the echo of the keys and the review keys.
+//   PINA_SPEECH_ERROR      the stderr of the commands, and their failures.
+//   PINA_SPEECH_PROMPT     the prompt and the messages of the shell.
+//   PINA_SPEECH_NARRATION  the stdout of the commands.
+//
+// The backend gets one utterance at a time, that stays here until it has
+// been spoken: an utterance preempts the one being spoken if that is less
+// important, and that one goes back to the head of its queue. The narration
+// is queued one line at a time ( cut at a space past PINA_SPEECH_LINE_BYTES ),
+// so that only the line that was interrupted is spoken again.
+// Past PINA_SPEECH_QUEUE_BYTES the narration waits in the backlog, a spill
+// buffer of null terminated texts, so that the narration of a huge output
+// is streamed from disk instead of being held in memory.
+
+#define PINA_SPEECH_QUEUE_BYTES (64 * 1024)
+#define PINA_SPEECH_LINE_BYTES  256
+
+typedef struct Utterance {
+    char             *text;
+    long              id;         // Message id, in the speech daemon.
+    struct Utterance *next;
+} Utterance;
+
+typedef struct SpeechQueue {
+    Utterance *head;
+    Utterance *tail;
+} SpeechQueue;
+
+SpeechQueue speech_queues[PINA_SPEECH_PRIORITIES];
+size_t      speech_queue_bytes = 0;
+
+// The utterance handed to the backend and its priority, NULL and -1 when
+// the backend is idle.
+Utterance  *speech_speaking          = NULL;
+int         speech_speaking_priority = -1;
+
+SpillBuffer speech_backlog = { { NULL, 0, 0 }, -1, 0, NULL, 0 };
+size_t      speech_backlog_read = 0;   // Offset of the next utterance.
+
+int speech_queued(void) {
+    for (int p = 0; p < PINA_SPEECH_PRIORITIES; p++) {
+        if (speech_queues[p].head != NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void speech_enqueue(const char *text, int priority) {
+    Utterance *u = malloc(sizeof(Utterance));
+    if (!u || !(u->text = strdup(text))) {
+        fprintf(stderr, "pina_shell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    u->id   = 0;
+    u->next = NULL;
+    SpeechQueue *q = &speech_queues[priority];
+    if (q->tail != NULL) {
+        q->tail->next = u;
+    } else {
+        q->head = u;
+    }
+    q->tail = u;
+    speech_queue_bytes += strlen(text);
+}
+
+// Silences the utterance being spoken and puts it back at the head of its
+// queue, to be spoken again after the more important one.
+void speech_preempt(void) {
+    speech->cancel();
+    Utterance *u = speech_speaking;
+    if (u != NULL) {
+        SpeechQueue *q = &speech_queues[speech_speaking_priority];
+        u->next = q->head;
+        q->head = u;
+        if (q->tail == NULL) {
+            q->tail = u;
+        }
+        speech_queue_bytes += strlen(u->text);
+    }
+    speech_speaking          = NULL;
+    speech_speaking_priority = -1;
+}
+
+// The backend spoke, or silenced, the utterance it had.
+void speech_speaking_done(void) {
+    if (speech_speaking != NULL) {
+        free(speech_speaking->text);
+        free(speech_speaking);
+    }
+    speech_speaking          = NULL;
+    speech_speaking_priority = -1;
+}
+
+// Moves narration from the backlog to the queue, while it fits.
+void speech_refill_from_backlog(void) {
+    size_t backlog_len = spill_buffer_len(&speech_backlog);
+    if (speech_backlog_read >= backlog_len) {
+        return;
+    }
+
+    const char *data = spill_buffer_data(&speech_backlog);
+    while (speech_backlog_read < backlog_len
+           && (!speech_queued() || speech_queue_bytes < PINA_SPEECH_QUEUE_BYTES)) {
+        const char *text = data + speech_backlog_read;
+        speech_enqueue(text, PINA_SPEECH_NARRATION);
+        speech_backlog_read += strlen(text) + 1;
+    }
+
+    if (speech_backlog_read >= backlog_len) {
+        spill_buffer_free(&speech_backlog);
+        speech_backlog_read = 0;
+    }
+}
+
+///  @brief Takes the most important utterance waiting.
+///  @param priority Set to the priority of the utterance taken.
+Utterance *speech_dequeue(int *priority) {
+    for (int p = 0; p < PINA_SPEECH_PRIORITIES; p++) {
+        SpeechQueue *q = &speech_queues[p];
+        Utterance *u = q->head;
+        if (u != NULL) {
+            q->head = u->next;
+            if (q->head == NULL) {
+                q->tail = NULL;
+            }
+            speech_queue_bytes -= strlen(u->text);
+            *priority = p;
+            return u;
+        }
+    }
+    return NULL;
+}
+
+///  @brief Hands the next utterance to the backend when it is done with the
+///         one it had.
+void speech_pump(void) {
+    while (!speech->busy()) {
+        speech_speaking_done();
+        if (speech_queues[PINA_SPEECH_NARRATION].head == NULL) {
+            speech_refill_from_backlog();
+        }
+        int priority;
+        Utterance *u = speech_dequeue(&priority);
+        if (u == NULL) {
+            break;
+        }
+        speech_utterance_priority = priority;
+        speech_speaking           = u;
+        speech_speaking_priority  = priority;
+        speech->speak(u->text);
+    }
+}
+
+///  @brief Drops the queued utterances and silences the one being spoken.
+void speech_cancel(void) {
+    Utterance *u;
+    int priority;
+    while ((u = speech_dequeue(&priority)) != NULL) {
+        free(u->text);
+        free(u);
+    }
+    spill_buffer_free(&speech_backlog);
+    speech_backlog_read = 0;
+    if (speech != NULL) {
+        speech->cancel();
+    }
+    speech_speaking_done();
+}
+
+///  @brief Drops the utterances queued with that priority ( and the backlog
+///         for the narration ), and silences the one being spoken if it
+///         has that priority.
+void speech_cancel_priority(int priority) {
+    SpeechQueue *q = &speech_queues[priority];
+    while (q->head != NULL) {
+        Utterance *u = q->head;
+        q->head = u->next;
+        speech_queue_bytes -= strlen(u->text);
+        free(u->text);
+        free(u);
+    }
+    q->tail = NULL;
+    if (priority == PINA_SPEECH_NARRATION) {
+        spill_buffer_free(&speech_backlog);
+        speech_backlog_read = 0;
+    }
+    if (speech != NULL && speech_speaking_priority == priority && speech->busy()) {
+        speech->cancel();
+        speech_speaking_done();
+    }
+    if (speech != NULL) {
+        speech_pump();
+    }
+}
+
+///  @brief Drops the narration queued, and silences it if it is being spoken.
+void speech_cancel_narration(void) {
+    speech_cancel_priority(PINA_SPEECH_NARRATION);
+}
+
+///  @brief 1 while there is speech queued or being spoken.
+int speech_active(void) {
+    return speech_queued() || spill_buffer_len(&speech_backlog) > 0 || speech->busy();
+}
+
+///  @brief A key was pressed: the shared speech daemon gives the focus to
+///         this shell.
+void speech_focus(void) {
+    if (speech != NULL) {
+        tts_socket_focus();
+    }
+}
+
+///  @brief Waits until everything queued has been spoken.
+void speech_flush(void) {
+    do {
+        speech->flush();
+        speech_pump();
+    } while (speech_speaking != NULL);
+}
+
+///  @brief Waits for the speech to end and closes the backend.
+///         Does nothing in forked children, that share the backend state.
+void speech_close(void) {
+    if (speech != NULL && getpid() == speech_owner_pid) {
+        speech_flush();
+        speech->close();
+        speech = NULL;
+    }
+}
+
+///  @brief Length of the first line of a narration: up to the end of its
+///         first " newline " or '\n', or cut at a space before
+///         PINA_SPEECH_LINE_BYTES ( inside a code point without one ).
+size_t speech_narration_line_len(const char *text) {
+    size_t len = strcspn(text, "\n") + (strchr(text, '\n') != NULL);
+    const char *newline = strstr(text, " newline ");
+    if (newline != NULL && (size_t) (newline - text) + strlen(" newline ") < len) {
+        len = (newline - text) + strlen(" newline ");
+    }
+    if (len <= PINA_SPEECH_LINE_BYTES) {
+        return len;
+    }
+
+    size_t cut = PINA_SPEECH_LINE_BYTES;
+    while (cut > 0 && text[cut - 1] != ' ') {
+        cut--;
+    }
+    if (cut == 0) {
+        cut = PINA_SPEECH_LINE_BYTES;
+        while (cut > 1 && utf8_is_continuation((unsigned char) text[cut])) {
+            cut--;
+        }
+    }
+    return cut;
+}
+
+///  @brief Queues a narration line by line, in the backlog once the queue
+///         is full.
+void speech_enqueue_narration(const char *text) {
+    char line[PINA_SPEECH_LINE_BYTES + 1];
+    while (*text) {
+        size_t len = speech_narration_line_len(text);
+        memcpy(line, text, len);
+        line[len] = '\0';
+        text += len;
+
+        if (spill_buffer_len(&speech_backlog) > 0
+            || (speech_queued() && speech_queue_bytes + len > PINA_SPEECH_QUEUE_BYTES)) {
+            spill_buffer_append(&speech_backlog, line, len + 1);
+        } else {
+            speech_enqueue(line, PINA_SPEECH_NARRATION);
+        }
+    }
+}
+
+///  @brief Queues a text to be spoken.
+///  @param priority One of PINA_SPEECH_ECHO ... PINA_SPEECH_NARRATION.
+void speak_audio_priority(const char *text, int priority) {
+    if (text == NULL || text[0] == '\0') {
+        return;
+    }
+    if (speech == NULL) {
+        speech_open(getenv("PINA_TTS"));
+    }
+
+    if (priority == PINA_SPEECH_NARRATION) {
+        speech_enqueue_narration(text);
+    } else {
+        speech_enqueue(text, priority);
+    }
+
+    // Interrupts what is being spoken if it is less important, it is
+    // spoken again after ( from its line, for a narration ).
+    if (speech_speaking_priority > priority && speech->busy()) {
+        speech_preempt();
+    }
+
+    speech_pump();
+}
+
+void speak_audio(char *text) {
+    speak_audio_priority(text, PINA_SPEECH_PROMPT);
+}
+
+void speak_echo(const char *text) {
+    speak_audio_priority(text, PINA_SPEECH_ECHO);
+}
+
+void speak_audio_char(char char_value) {
+    char char_str[2];
+    char_str[0] = char_value;
+    char_str[1] = '\0';
+    speak_echo( char_str );
+}
+
+// Echoes one code point, the len bytes at s.
+void speak_code_point(const char *s, int len) {
+    char code_point_str[5];
+    if (len < 1 || len > 4) {
+        return;
+    }
+    memcpy(code_point_str, s, len);
+    code_point_str[len] = '\0';
+    speak_echo( code_point_str );
+}
+
+// Echo of the typed keys, set with PINA_ECHO, "announce echo MODE" or
+// cycled with Alt-e:
+//   both        each character, and each word when a space ends it.
+//   characters  each character, a word costs as many utterances.
+//   words       only the words, one utterance each.
+//   silent      nothing, Alt-r reads the line typed so far.
+// The tones of the earcons still play in every mode.
+
+int echo_mode = PINA_ECHO_BOTH;
+
+// Names of the modes, indexed by the mode, and the order of Alt-e.
+const char *echo_mode_names[] = { "silent", "characters", "words", "both" };
+const int   echo_mode_cycle[] = { PINA_ECHO_BOTH, PINA_ECHO_WORDS,
+                                  PINA_ECHO_CHARACTERS, PINA_ECHO_SILENT };
+
+///  @brief The mode with that name, or -1.
+int echo_mode_from_name(const char *name) {
+    for (int mode = 0; mode < 4; mode++) {
+        if (strcmp(name, echo_mode_names[mode]) == 0) {
+            return mode;
+        }
+    }
+    return -1;
+}
+
+void echo_config_from_env(void) {
+    const char *value = getenv("PINA_ECHO");
+    if (value != NULL && echo_mode_from_name(value) >= 0) {
+        echo_mode = echo_mode_from_name(value);
+    } else if (value != NULL) {
+        fprintf(stderr, "pina_shell: unknown PINA_ECHO %s, using %s\n", value,
+                echo_mode_names[echo_mode]);
+    }
+}
+
+///  @brief Alt-e, goes to the next echo mode and tells it.
+void echo_mode_next(void) {
+    int i = 0;
+    while (echo_mode_cycle[i] != echo_mode) {
+        i++;
+    }
+    echo_mode = echo_mode_cycle[(i + 1) % 4];
+    char text[64];
+    snprintf(text, sizeof(text), "echo %s", echo_mode_names[echo_mode]);
+    speak_echo(text);
+}
+
+// Echoes a typed character, unless the echo mode leaves them out.
+void echo_character(const char *s, int len) {
+    if (echo_mode & PINA_ECHO_CHARACTERS) {
+        speak_code_point(s, len);
+    }
+}
+
+// ***************************************************************
+
+// ***************************************************************
+// Earcons ( implementation ).
+//
+// Short tones that stand in for the words of the structural keys ( space,
+// tab, backspace, the arrows and the ends of the history ) and mark the
+// start, the end and the failure of the commands. They are synthesized
+// once in memory as PCM and written to a player that stays open, so that
+// a key is heard without any call to the TTS.
+//
+// PINA_EARCONS=1, or "announce earcons on", turns them on. The player is
+// PINA_EARCON_PLAYER, that reads raw 16 bit mono PCM at 22050 Hz on stdin,
+// by default aplay with a short buffer. Without a player, or once it has
+// exited, the words are spoken as before.
+
+#define PINA_EARCON_RATE 22050
+#define PINA_EARCON_DEFAULT_PLAYER "aplay -q -t raw -f S16_LE -c 1 -r 22050 --buffer-time=20000"
+
+#define PINA_EARCON_SPACE          0
+#define PINA_EARCON_TAB            1
+#define PINA_EARCON_BACKSPACE      2
+#define PINA_EARCON_UP_ARROW       3
+#define PINA_EARCON_DOWN_ARROW     4
+#define PINA_EARCON_END_LIST       5
+#define PINA_EARCON_BEGIN_LIST     6
+#define PINA_EARCON_COMMAND_START  7
+#define PINA_EARCON_COMMAND_DONE   8
+#define PINA_EARCON_COMMAND_ERROR  9
+#define PINA_EARCON_ALERT         10
+#define PINA_EARCON_COUNT         11
+
+int       earcons_enabled    = 0;
+DynBuffer earcon_pcm[PINA_EARCON_COUNT];
+int       earcon_synthesized = 0;
+pid_t     earcon_player_pid  = 0;
+int       earcon_player_fd   = -1;
+
+// The rest of an earcon the pipe didn't take, written before the next one
+// so that the player never reads half a sample.
+const char *earcon_pending     = NULL;
+size_t      earcon_pending_len = 0;
+
+// Appends a tone that glides from freq_start to freq_end, with a short
+// attack and an exponential decay, so that it doesn't click.
+void earcon_tone(DynBuffer *pcm, double freq_start, double freq_end, double ms, double volume) {
+    int num_samples = PINA_EARCON_RATE * ms / 1000.0;
+    int attack      = PINA_EARCON_RATE * 0.002;
+    double phase = 0.0;
+    for (int i = 0; i < num_samples; i++) {
+        double t    = (double) i / num_samples;
+        double freq = freq_start + (freq_end - freq_start) * t;
+        double envelope = (i < attack) ? (double) i / attack : 1.0;
+        envelope *= exp(-4.0 * t);
+        phase += 2.0 * M_PI * freq / PINA_EARCON_RATE;
+        int16_t sample = (int16_t) (sin(phase) * envelope * volume * 32767.0);
+        dyn_buffer_append(pcm, (const char *) &sample, sizeof(sample));
+    }
+}
+
+void earcon_silence(DynBuffer *pcm, double ms) {
+    int num_samples = PINA_EARCON_RATE * ms / 1000.0;
+    int16_t sample = 0;
+    for (int i = 0; i < num_samples; i++) {
+        dyn_buffer_append(pcm, (const char *) &sample, sizeof(sample));
+    }
+}
+
+void earcon_synthesize(void) {
+    for (int i = 0; i < PINA_EARCON_COUNT; i++) {
+        dyn_buffer_init(&earcon_pcm[i]);
+    }
+    // Clicks for the blanks, two for the tab.
+    earcon_tone(&earcon_pcm[PINA_EARCON_SPACE], 2000, 2000, 8, 0.4);
+    earcon_tone(&earcon_pcm[PINA_EARCON_TAB], 2000, 2000, 8, 0.4);
+    earcon_silence(&earcon_pcm[PINA_EARCON_TAB], 20);
+    earcon_tone(&earcon_pcm[PINA_EARCON_TAB], 2000, 2000, 8, 0.4);
+    // A falling chirp for the erase.
+    earcon_tone(&earcon_pcm[PINA_EARCON_BACKSPACE], 1400, 700, 30, 0.4);
+    // Rising up, falling down the history, a low buzz at its ends.
+    earcon_tone(&earcon_pcm[PINA_EARCON_UP_ARROW], 800, 1200, 30, 0.4);
+    earcon_tone(&earcon_pcm[PINA_EARCON_DOWN_ARROW], 1200, 800, 30, 0.4);
+    earcon_tone(&earcon_pcm[PINA_EARCON_END_LIST], 220, 220, 80, 0.5);
+    earcon_tone(&earcon_pcm[PINA_EARCON_BEGIN_LIST], 220, 220, 80, 0.5);
+    // The commands: a soft tick, two rising notes, two falling notes.
+    earcon_tone(&earcon_pcm[PINA_EARCON_COMMAND_START], 600, 600, 25, 0.3);
+    earcon_tone(&earcon_pcm[PINA_EARCON_COMMAND_DONE], 880, 880, 50, 0.4);
+    earcon_tone(&earcon_pcm[PINA_EARCON_COMMAND_DONE], 1320, 1320, 70, 0.4);
+    earcon_tone(&earcon_pcm[PINA_EARCON_COMMAND_ERROR], 440, 440, 90, 0.5);
+    earcon_tone(&earcon_pcm[PINA_EARCON_COMMAND_ERROR], 330, 330, 140, 0.5);
+    // Two high beeps for a keyword in the output.
+    earcon_tone(&earcon_pcm[PINA_EARCON_ALERT], 1760, 1760, 40, 0.5);
+    earcon_silence(&earcon_pcm[PINA_EARCON_ALERT], 30);
+    earcon_tone(&earcon_pcm[PINA_EARCON_ALERT], 1760, 1760, 40, 0.5);
+    earcon_synthesized = 1;
+}
+
+void earcon_stop_player(void) {
+    earcon_pending     = NULL;
+    earcon_pending_len = 0;
+    if (earcon_player_fd >= 0) {
+        close(earcon_player_fd);
+        earcon_player_fd = -1;
+    }
+    if (earcon_player_pid > 0) {
+        kill(earcon_player_pid, SIGKILL);
+        while (waitpid(earcon_player_pid, NULL, 0) == -1 && errno == EINTR) {
+        }
+        earcon_player_pid = 0;
+    }
+}
+
+void earcon_close(void) {
+    if (getpid() == speech_owner_pid) {
+        earcon_stop_player();
+    }
+}
+
+// Starts the player, in its own process group so that Ctrl-C doesn't kill it.
+int earcon_start_player(void) {
+    const char *player = getenv("PINA_EARCON_PLAYER");
+    if (!tts_command_found(player ? player : PINA_EARCON_DEFAULT_PLAYER)) {
+        return -1;
+    }
+    char *args[] = { "/bin/sh", "-c", (char *) (player ? player : PINA_EARCON_DEFAULT_PLAYER), NULL };
+    int fd;
+    pid_t pid = tts_spawn_with_pipe(args, STDIN_FILENO, &fd, 1);
+    if (pid <= 0) {
+        return -1;
+    }
+    // A full pipe drops the earcon, the event loop never waits for audio.
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    earcon_player_pid = pid;
+    earcon_player_fd  = fd;
+
+    static int registered = 0;
+    if (!registered) {
+        atexit(earcon_close);
+        registered = 1;
+    }
+    return 0;
+}
+
+///  @brief Plays an earcon, if they are on.
+///  @param earcon One of PINA_EARCON_SPACE ... PINA_EARCON_COMMAND_ERROR.
+///  @return 1 if it was played, 0 if the caller should speak instead.
+int earcon_play(int earcon) {
+    if (!earcons_enabled) {
+        return 0;
+    }
+    if (!earcon_synthesized) {
+        earcon_synthesize();
+    }
+    if (earcon_player_fd < 0 && earcon_start_player() != 0) {
+        earcons_enabled = 0;
+        return 0;
+    }
+
+    // A player that died must not kill the shell with SIGPIPE.
+    sigset_t sigpipe, old_mask;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, &old_mask);
+
+    // The rest of the previous earcon first. Then the earcon only if the
+    // pipe has room for all of it, a full pipe drops it.
+    int player_died = 0;
+    if (earcon_pending_len > 0) {
+        ssize_t n = write(earcon_player_fd, earcon_pending, earcon_pending_len);
+        if (n > 0) {
+            earcon_pending     += n;
+            earcon_pending_len -= n;
+        }
+        player_died = n < 0 && errno == EPIPE;
+    }
+    int queued = 0;
+    if (!player_died && earcon_pending_len == 0
+        && ioctl(earcon_player_fd, FIONREAD, &queued) == 0
+        && (size_t) (fcntl(earcon_player_fd, F_GETPIPE_SZ) - queued) >= earcon_pcm[earcon].len) {
+        ssize_t n = write(earcon_player_fd, earcon_pcm[earcon].data, earcon_pcm[earcon].len);
+        if (n >= 0 && (size_t) n < earcon_pcm[earcon].len) {
+            earcon_pending     = earcon_pcm[earcon].data + n;
+            earcon_pending_len = earcon_pcm[earcon].len - n;
+        }
+        player_died = n < 0 && errno == EPIPE;
+    }
+
+    if (player_died) {
+        // The player is gone ( no sound device ), the words are spoken.
+        struct timespec no_wait = { 0, 0 };
+        sigtimedwait(&sigpipe, NULL, &no_wait);
+        earcon_stop_player();
+        earcons_enabled = 0;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    return !player_died;
+}
+
+///  @brief Plays the earcon of a structural key, or speaks its word.
+void speak_earcon(int earcon, const char *word) {
+    if (!earcon_play(earcon)) {
+        speak_echo(word);
+    }
+}
+
+// Echoes a typed key with its tone, or with its name if the echo mode
+// speaks that kind of key ( say is 1 ).
+void echo_earcon(int earcon, const char *word, int say) {
+    if (!earcon_play(earcon) && say) {
+        speak_echo(word);
+    }
+}
+
+// ***************************************************************
+
+// ***************************************************************
+// Double linked list of strings ( implementation ).
+
+// Function to initialize the linked list
+void list_init(LinkedList *list) {
+    list->head = NULL;
+    list->tail = NULL;
+    list->size = 0;
+}
+
+// Append a string to the beginning of the linked list
+void list_append_first(LinkedList *list, char *str) {
+    Node *newNode = (Node *)malloc(sizeof(Node));
+    newNode->data = strdup(str);  // Copy the string
+    newNode->next = list->head;
+    newNode->prev = NULL;
+
+    if (list->head) {
+        list->head->prev = newNode;
+    } else {
+        // If the list is empty, new node is also the tail
+        list->tail = newNode;
+    }
+
+    list->head = newNode;
+    list->size++;
+}
+
+// Get data at a specific index
+char *list_get_at(LinkedList *list, int index) {
+    if (index < 0 || index >= list->size) {
+        return NULL;  // Out of bounds
+    }
+
+    Node *current = list->head;
+    for (int i = 0; i < index; i++) {
+        current = current->next;
+    }
+    return current->data;
+}
+
+// Delete a node from the list
+void list_delete(LinkedList *list, Node *node) {
+    if (node->prev) {
+        node->prev->next = node->next;
+    } else {
+        // If node is head
+        list->head = node->next;
+    }
+
+    if (node->next) {
+        node->next->prev = node->prev;
+    } else {
+        // If node is tail
+        list->tail = node->prev;
+    }
+
+    free(node->data);
+    free(node);
+    list->size--;
+}
+
+// Get the first node
+Node *list_first(LinkedList *list) {
+    return list->head;
+}
+
+// Get the last node
+Node *list_last(LinkedList *list) {
+    return list->tail;
+}
+
+// Get the next node
+Node *list_next(Node *node) {
+    return node->next;
+}
+
+// Get the previous node
+Node *list_prev(Node *node) {
+    return node->prev;
+}
+
+// Get the node data
+char *list_get_data(Node *node) {
+    return node->data;
+}
+
+// Function to free up memory for entire list
+void list_free(LinkedList *list) {
+    Node *current = list->head;
+    while (current) {
+        Node *nextNode = current->next;
+        free(current->data);
+        free(current);
+        current = nextNode;
+    }
+}
+
+void list_print_reverse(LinkedList *list) {
+    int list_size = list->size;    
+    
+    if (list_size > 15 /* 12 */) {
+        // Remove the last element
+        list_delete( list, list->tail );
+    }
+    
+    list_size = list->size - 1;
+    Node *current = list->tail;  // Start by the end (tail)
+    while (current) {
+        printf(" %2d : %s\n", list_size--, current->data);
+        current = current->prev;  // Navigate to the previous element.
+    }
+}
+
+// ***************************************************************
+
+
+// ***************************************************************
+// Review buffer ( implementation ).
+//
+// Keeps the captured output (stdout and stderr, in arrival order) of the
+// last PINA_REVIEW_MAX_OUTPUTS commands, with an index of the start of
+// every line, so that the user can move a review cursor over it by line,
+// word or character and hear it again without re-running the command.
+// The text and the index are spill buffers, so outputs of any size fit.
+
+#define PINA_REVIEW_MAX_OUTPUTS 10
+
+typedef struct ReviewOutput {
+    char         *command;       // The command line that produced the output.
+    SpillBuffer   text;
+    SpillBuffer   lines;         // size_t offset in text of each line start.
+    int           at_line_start; // The next byte appended starts a line.
+    DynBuffer     bookmarks;     // size_t offsets of the lines with alerts.
+
+    // View of the buffers, refreshed by review_output_view().
+    const char   *data;
+    size_t        len;
+    const size_t *line_start;
+    int           num_lines;
+} ReviewOutput;
+
+typedef struct ReviewBuffer {
+    ReviewOutput outputs[PINA_REVIEW_MAX_OUTPUTS];  // Ring buffer.
+    int          newest;     // Index in outputs of the most recent output.
+    int          count;
+
+    // Review cursor.
+    int          cursor_age; // 0 is the most recent output, 1 the one before.
+    size_t       cursor_pos; // Byte offset in the text of that output.
+    int          chunk_lines; // Lines read from the cursor line on, for Alt-.
+} ReviewBuffer;
+
+ReviewBuffer review;
+
+void review_init(ReviewBuffer *rb) {
+    memset(rb, 0, sizeof(*rb));
+    for (int i = 0; i < PINA_REVIEW_MAX_OUTPUTS; i++) {
+        spill_buffer_init(&rb->outputs[i].text);
+        spill_buffer_init(&rb->outputs[i].lines);
+    }
+    rb->newest = -1;
+}
+
+void review_output_free(ReviewOutput *out) {
+    free(out->command);
+    spill_buffer_free(&out->text);
+    spill_buffer_free(&out->lines);
+    dyn_buffer_free(&out->bookmarks);
+    memset(out, 0, sizeof(*out));
+    spill_buffer_init(&out->text);
+    spill_buffer_init(&out->lines);
+}
+
+void review_free(ReviewBuffer *rb) {
+    for (int i = 0; i < PINA_REVIEW_MAX_OUTPUTS; i++) {
+        review_output_free(&rb->outputs[i]);
+    }
+    review_init(rb);
+}
+
+// Get the output of age "age" ( 0 is the most recent ), or NULL.
+ReviewOutput *review_get(ReviewBuffer *rb, int age) {
+    if (age < 0 || age >= rb->count) {
+        return NULL;
+    }
+    int index = (rb->newest - age + PINA_REVIEW_MAX_OUTPUTS) % PINA_REVIEW_MAX_OUTPUTS;
+    return &rb->outputs[index];
+}
+
+// Starts a new output, evicting the oldest one if the ring is full.
+ReviewOutput *review_begin_output(ReviewBuffer *rb, const char *command) {
+    rb->newest = (rb->newest + 1) % PINA_REVIEW_MAX_OUTPUTS;
+    if (rb->count < PINA_REVIEW_MAX_OUTPUTS) {
+        rb->count++;
+    }
+
+    ReviewOutput *out = &rb->outputs[rb->newest];
+    review_output_free(out);
+    out->command = strdup(command ? command : "");
+    out->at_line_start = 1;
+
+    rb->cursor_age  = 0;
+    rb->cursor_pos  = 0;
+    rb->chunk_lines = 0;
+    return out;
+}
+
+// Appends captured bytes and indexes the lines they start.
+void review_output_append(ReviewOutput *out, const char *data, size_t len) {
+    size_t offset = spill_buffer_len(&out->text);
+    spill_buffer_append(&out->text, data, len);
+
+    for (size_t i = 0; i < len; i++) {
+        if (out->at_line_start) {
+            size_t pos = offset + i;
+            spill_buffer_append(&out->lines, &pos, sizeof(pos));
+        }
+        out->at_line_start = (data[i] == '\n');
+    }
+}
+
+// Refreshes the view of the text and of the line index.
+void review_output_view(ReviewOutput *out) {
+    out->data       = spill_buffer_data(&out->text);
+    out->len        = spill_buffer_len(&out->text);
+    out->line_start = (const size_t *) spill_buffer_data(&out->lines);
+    out->num_lines  = spill_buffer_len(&out->lines) / sizeof(size_t);
+}
+
+// Returns the line that contains the byte offset pos ( binary search ).
+int review_output_line_of(ReviewOutput *out, size_t pos) {
+    int low = 0, high = out->num_lines - 1;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (out->line_start[mid] <= pos) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+// Gets the bounds [start, end[ of a line, without the newline.
+void review_output_line_bounds(ReviewOutput *out, int line, size_t *start, size_t *end) {
+    *start = out->line_start[line];
+    *end   = (line + 1 < out->num_lines) ? out->line_start[line + 1] : out->len;
+    if (*end > *start && out->data[*end - 1] == '\n') {
+        (*end)--;
+    }
+}
+
+// Speaks the bytes [start, end[ of the output, or "blank" if empty.
+void review_speak_range(ReviewOutput *out, size_t start, size_t end) {
+    if (end <= start) {
+        speak_echo("blank");
+        return;
+    }
+    char *text = strndup(out->data + start, end - start);
+    speak_echo(text);
+    free(text);
+}
+
+void review_speak_char_at(ReviewOutput *out, size_t pos) {
+    char c = out->data[pos];
+    if (c == '\n') {
+        speak_echo("newline");
+    } else if (c == ' ') {
+        speak_echo("space");
+    } else if (c == '\t') {
+        speak_echo("tab");
+    } else {
+        speak_code_point(out->data + pos, (int) (utf8_next(out->data, out->len, pos) - pos));
+    }
+}
+
+void review_speak_word_at(ReviewOutput *out, size_t pos) {
+    const char *text = out->data;
+    if (isspace((unsigned char) text[pos])) {
+        review_speak_char_at(out, pos);
+        return;
+    }
+    size_t start = pos, end = pos;
+    while (start > 0 && !isspace((unsigned char) text[start - 1])) {
+        start--;
+    }
+    while (end < out->len && !isspace((unsigned char) text[end])) {
+        end++;
+    }
+    review_speak_range(out, start, end);
+}
+
+void review_speak_line_at(ReviewOutput *out, size_t pos) {
+    size_t start, end;
+    review_output_line_bounds(out, review_output_line_of(out, pos), &start, &end);
+    review_speak_range(out, start, end);
+}
+
+// Announces the output under the review cursor.
+void review_speak_output_summary(ReviewBuffer *rb) {
+    ReviewOutput *out = review_get(rb, rb->cursor_age);
+    review_output_view(out);
+    char summary[512];
+    snprintf(summary, sizeof(summary), "output %d of %d, %.300s, %d lines",
+             rb->count - rb->cursor_age, rb->count, out->command, out->num_lines);
+    speak_echo(summary);
+}
+
+// Skimming of large outputs. Past PINA_SKIM_LINES lines or PINA_SKIM_BYTES
+// bytes an output isn't narrated: when its command ends, its size and its
+// first and last PINA_SKIM_CONTEXT_LINES lines are spoken, and Alt-. and
+// Alt-, read the rest in chunks of PINA_SKIM_CHUNK_LINES lines. The line
+// index of the output is built as it arrives, so the summary costs the
+// same for any size. PINA_SKIM_LINES=0 narrates every output in full.
+
+#define PINA_SKIM_LINES         100
+#define PINA_SKIM_BYTES         (16 * 1024)
+#define PINA_SKIM_CONTEXT_LINES 3
+#define PINA_SKIM_CHUNK_LINES   20
+
+// Longer lines are cut in the summary.
+#define PINA_SKIM_MAX_LINE      200
+
+int skim_lines       = PINA_SKIM_LINES;
+int skim_chunk_lines = PINA_SKIM_CHUNK_LINES;
+
+void skim_config_from_env(void) {
+    const char *lines = getenv("PINA_SKIM_LINES");
+    const char *chunk = getenv("PINA_SKIM_CHUNK");
+    if (lines != NULL) {
+        skim_lines = atoi(lines);
+    }
+    if (chunk != NULL && atoi(chunk) > 0) {
+        skim_chunk_lines = atoi(chunk);
+    }
+}
+
+///  @brief 1 if the output is too large to be narrated.
+int skim_output_is_large(ReviewOutput *out) {
+    return skim_lines > 0
+        && (spill_buffer_len(&out->lines) / sizeof(size_t) > (size_t) skim_lines
+            || spill_buffer_len(&out->text) > PINA_SKIM_BYTES);
+}
+
+// Appends the lines [first, last[ of the output, each cut and ended by a
+// newline.
+void skim_append_lines(ReviewOutput *out, int first, int last, DynBuffer *text) {
+    for (int line = first; line < last; line++) {
+        size_t start, end;
+        review_output_line_bounds(out, line, &start, &end);
+        if (end - start > PINA_SKIM_MAX_LINE) {
+            end = utf8_prev(out->data, start + PINA_SKIM_MAX_LINE + 1);
+        }
+        if (end > start) {
+            dyn_buffer_append(text, out->data + start, end - start);
+        } else {
+            dyn_buffer_append(text, "blank", 5);
+        }
+        dyn_buffer_append(text, "\n", 1);
+    }
+}
+
+void skim_describe_size(size_t bytes, char *text, size_t size) {
+    if (bytes < 1024) {
+        snprintf(text, size, "%zu bytes", bytes);
+    } else if (bytes < 1024 * 1024) {
+        snprintf(text, size, "%zu kilobytes", bytes / 1024);
+    } else {
+        snprintf(text, size, "%.1f megabytes", bytes / (1024.0 * 1024.0));
+    }
+}
+
+///  @brief Speaks the size, the first and the last lines of the output.
+///  @param priority One of PINA_SPEECH_ECHO ... PINA_SPEECH_NARRATION.
+void skim_speak_summary(ReviewOutput *out, int priority) {
+    review_output_view(out);
+    char size[64];
+    char header[160];
+    skim_describe_size(out->len, size, sizeof(size));
+    snprintf(header, sizeof(header), "%d %s, %s.\n", out->num_lines,
+             out->num_lines == 1 ? "line" : "lines", size);
+
+    DynBuffer text;
+    dyn_buffer_init(&text);
+    dyn_buffer_append(&text, header, strlen(header));
+    int context = PINA_SKIM_CONTEXT_LINES;
+    if (out->num_lines <= 2 * context) {
+        skim_append_lines(out, 0, out->num_lines, &text);
+    } else {
+        dyn_buffer_append(&text, "First lines:\n", strlen("First lines:\n"));
+        skim_append_lines(out, 0, context, &text);
+        dyn_buffer_append(&text, "Last lines:\n", strlen("Last lines:\n"));
+        skim_append_lines(out, out->num_lines - context, out->num_lines, &text);
+        dyn_buffer_append(&text, "Alt-period reads on.", strlen("Alt-period reads on."));
+    }
+    speak_audio_priority(text.data, priority);
+    dyn_buffer_free(&text);
+}
+
+///  @brief Reads the next ( Alt-. ) or the previous ( Alt-, ) chunk of lines
+///         of the output under the review cursor, that moves to its start.
+///         It interrupts the speech, to skip through the chunks quickly.
+void skim_speak_chunk(ReviewBuffer *rb, ReviewOutput *out, int forward) {
+    int line = review_output_line_of(out, rb->cursor_pos);
+    int first = forward ? line + rb->chunk_lines : line - skim_chunk_lines;
+    if (!forward && line == 0) {
+        speak_echo("top");
+        return;
+    }
+    if (first >= out->num_lines) {
+        speak_echo("bottom");
+        return;
+    }
+    first = first < 0 ? 0 : first;
+    int last = first + skim_chunk_lines;
+    last = last > out->num_lines ? out->num_lines : last;
+
+    char header[96];
+    snprintf(header, sizeof(header), "lines %d to %d of %d\n", first + 1, last, out->num_lines);
+    DynBuffer text;
+    dyn_buffer_init(&text);
+    dyn_buffer_append(&text, header, strlen(header));
+    skim_append_lines(out, first, last, &text);
+
+    rb->cursor_pos  = out->line_start[first];
+    rb->chunk_lines = last - first;
+    // The stderr and the alerts still queued are kept.
+    speech_cancel_priority(PINA_SPEECH_ECHO);
+    speech_cancel_narration();
+    speak_audio_priority(text.data, PINA_SPEECH_NARRATION);
+    dyn_buffer_free(&text);
+}
+
+///  @brief Handles the review keys, that are Alt (Escape) followed by c.
+///         The layout follows the numeric keypad of the Linux screen readers:
+///           Alt-7 / Alt-8 / Alt-9   previous / current / next line
+///           Alt-4 / Alt-5 / Alt-6   previous / current / next word
+///           Alt-1 / Alt-2 / Alt-3   previous / current / next character
+///           Alt-- / Alt-=           older / newer command output
+///           Alt-0                   next line with an alert
+///           Alt-, / Alt-.           previous / next chunk of lines
+///           Alt-/                   size, first and last lines
+///  @param c The character that followed the escape.
+///  @return 1 if c was a review key, 0 otherwise.
+int review_handle_key(ReviewBuffer *rb, int c) {
+    if (strchr("0123456789-=,./", c) == NULL || c == '\0') {
+        return 0;
+    }
+
+    if (rb->count == 0) {
+        speak_echo("No output to review");
+        return 1;
+    }
+
+    if (c == '-' || c == '=') {
+        int age = rb->cursor_age + (c == '-' ? 1 : -1);
+        if (age < 0 || age >= rb->count) {
+            speak_echo(c == '-' ? "oldest output" : "newest output");
+            return 1;
+        }
+        rb->cursor_age  = age;
+        rb->cursor_pos  = 0;
+        rb->chunk_lines = 0;
+        review_speak_output_summary(rb);
+        return 1;
+    }
+
+    ReviewOutput *out = review_get(rb, rb->cursor_age);
+    review_output_view(out);
+    if (out->len == 0) {
+        speak_echo("Empty output");
+        return 1;
+    }
+
+    if (c == ',' || c == '.') {
+        skim_speak_chunk(rb, out, c == '.');
+        return 1;
+    }
+    if (c == '/') {
+        skim_speak_summary(out, PINA_SPEECH_ECHO);
+        return 1;
+    }
+
+    // The other keys read one line, or less, at the cursor.
+    size_t pos  = rb->cursor_pos;
+    int    line = review_output_line_of(out, pos);
+    rb->chunk_lines = 1;
+
+    switch (c) {
+        case '0': {
+            // The next bookmark after the cursor, from the top after the last.
+            const size_t *marks = (const size_t *) out->bookmarks.data;
+            int num_marks = out->bookmarks.len / sizeof(size_t);
+            if (num_marks == 0) {
+                speak_echo("No alerts");
+                return 1;
+            }
+            int m = 0;
+            while (m < num_marks && out->line_start[review_output_line_of(out, marks[m])] <= pos) {
+                m++;
+            }
+            if (m == num_marks) {
+                speak_echo("first alert");
+                m = 0;
+            }
+            line = review_output_line_of(out, marks[m]);
+            rb->cursor_pos = out->line_start[line];
+            review_speak_line_at(out, rb->cursor_pos);
+            break;
+        }
+        case '7':
+        case '9':
+            line += (c == '7') ? -1 : 1;
+            if (line < 0 || line >= out->num_lines) {
+                speak_echo(c == '7' ? "top" : "bottom");
+                return 1;
+            }
+            rb->cursor_pos = out->line_start[line];
+            review_speak_line_at(out, rb->cursor_pos);
+            break;
+        case '8':
+            review_speak_line_at(out, pos);
+            break;
+        case '4':
+            // To the start of the current word, then to the previous word.
+            if (!isspace((unsigned char) out->data[pos])) {
+                while (pos > 0 && !isspace((unsigned char) out->data[pos - 1])) {
+                    pos--;
+                }
+            }
+            while (pos > 0 && isspace((unsigned char) out->data[pos - 1])) {
+                pos--;
+            }
+            if (pos == 0) {
+                speak_echo("top");
+                return 1;
+            }
+            while (pos > 0 && !isspace((unsigned char) out->data[pos - 1])) {
+                pos--;
+            }
+            rb->cursor_pos = pos;
+            review_speak_word_at(out, pos);
+            break;
+        case '5':
+            review_speak_word_at(out, pos);
+            break;
+        case '6':
+            while (pos < out->len && !isspace((unsigned char) out->data[pos])) {
+                pos++;
+            }
+            while (pos < out->len && isspace((unsigned char) out->data[pos])) {
+                pos++;
+            }
+            if (pos >= out->len) {
+                speak_echo("bottom");
+                return 1;
+            }
+            rb->cursor_pos = pos;
+            review_speak_word_at(out, pos);
+            break;
+        case '1':
+            if (pos == 0) {
+                speak_echo("top");
+                return 1;
+            }
+            rb->cursor_pos = utf8_prev(out->data, pos);
+            review_speak_char_at(out, rb->cursor_pos);
+            break;
+        case '2':
+            review_speak_char_at(out, pos);
+            break;
+        case '3':
+            if (utf8_next(out->data, out->len, pos) >= out->len) {
+                speak_echo("bottom");
+                return 1;
+            }
+            rb->cursor_pos = utf8_next(out->data, out->len, pos);
+            review_speak_char_at(out, rb->cursor_pos);
+            break;
+    }
+    return 1;
+}
+
+// ***************************************************************
+
+// ***************************************************************
+// Keyword alerts ( implementation ).
+//
+// The stdout and stderr of the commands are scanned for keywords, like
+// "error:" or "FAILED", by an Aho-Corasick automaton compiled at startup
+// into a table with one transition per state and byte, so that the scan
+// is one lookup per byte. The keywords match ignoring the case of ASCII
+// letters. A line that matches is bookmarked in the review buffer ( Alt-0
+// jumps to the next one ) and alerted at once, with the alert earcon or
+// by speaking the keyword before the narration; past the first alert of
+// a command, at most one alert per PINA_ALERT_INTERVAL_SEC.
+//
+// PINA_ALERTS is the list of keywords separated by commas, empty for none.
+
+#define PINA_ALERTS_DEFAULT "error:,error[,FAILED,fatal:,panic:,Traceback,Segmentation fault,undefined reference"
+#define PINA_ALERT_INTERVAL_SEC 1.0
+
+typedef struct AlertMatcher {
+    int   (*next)[256];    // The transitions, next[state][byte].
+    int    *keyword;       // Keyword ending in the state, or -1.
+    int     num_states;
+    char  **keywords;
+    int     num_keywords;
+} AlertMatcher;
+
+AlertMatcher alerts = { NULL, NULL, 0, NULL, 0 };
+
+static unsigned char alert_fold(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+void alert_matcher_free(AlertMatcher *m) {
+    for (int i = 0; i < m->num_keywords; i++) {
+        free(m->keywords[i]);
+    }
+    free(m->keywords);
+    free(m->next);
+    free(m->keyword);
+    memset(m, 0, sizeof(*m));
+}
+
+///  @brief Compiles the keywords, separated by commas, into the matcher.
+///         The blanks around each keyword are not part of it.
+void alert_matcher_compile(AlertMatcher *m, const char *list) {
+    alert_matcher_free(m);
+
+    // The keywords, and an upper bound of the states: one per byte + root.
+    char *copy = strdup(list);
+    char *saveptr = NULL;
+    int max_states = 1;
+    for (char *word = strtok_r(copy, ",", &saveptr); word != NULL; word = strtok_r(NULL, ",", &saveptr)) {
+        while (isspace((unsigned char) *word)) {
+            word++;
+        }
+        size_t len = strlen(word);
+        while (len > 0 && isspace((unsigned char) word[len - 1])) {
+            word[--len] = '\0';
+        }
+        if (word[0] == '\0') {
+            continue;
+        }
+        m->keywords = realloc(m->keywords, (m->num_keywords + 1) * sizeof(char *));
+        if (!m->keywords) {
+            fprintf(stderr, "pina_shell: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        m->keywords[m->num_keywords++] = strdup(word);
+        max_states += strlen(word);
+    }
+    free(copy);
+    if (m->num_keywords == 0) {
+        return;
+    }
+
+    m->next    = malloc(max_states * sizeof(*m->next));
+    m->keyword = malloc(max_states * sizeof(int));
+    int *fail  = malloc(max_states * sizeof(int));
+    int *queue = malloc(max_states * sizeof(int));
+    if (!m->next || !m->keyword || !fail || !queue) {
+        fprintf(stderr, "pina_shell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(m->next[0], -1, sizeof(m->next[0]));
+    m->keyword[0]  = -1;
+    m->num_states  = 1;
+
+    // The trie of the folded keywords.
+    for (int k = 0; k < m->num_keywords; k++) {
+        int state = 0;
+        for (const unsigned char *p = (const unsigned char *) m->keywords[k]; *p; p++) {
+            unsigned char c = alert_fold(*p);
+            if (m->next[state][c] < 0) {
+                int s = m->num_states++;
+                memset(m->next[s], -1, sizeof(m->next[s]));
+                m->keyword[s] = -1;
+                m->next[state][c] = s;
+            }
+            state = m->next[state][c];
+        }
+        if (m->keyword[state] < 0) {
+            m->keyword[state] = k;
+        }
+    }
+
+    // Breadth first, the failure links complete the transitions, so that
+    // the scan never follows them.
+    int head = 0, tail = 0;
+    for (int c = 0; c < 256; c++) {
+        if (m->next[0][c] < 0) {
+            m->next[0][c] = 0;
+        } else {
+            fail[m->next[0][c]] = 0;
+            queue[tail++] = m->next[0][c];
+        }
+    }
+    while (head < tail) {
+        int state = queue[head++];
+        if (m->keyword[state] < 0) {
+            m->keyword[state] = m->keyword[fail[state]];
+        }
+        for (int c = 0; c < 256; c++) {
+            int s = m->next[state][c];
+            if (s < 0) {
+                m->next[state][c] = m->next[fail[state]][c];
+            } else {
+                fail[s] = m->next[fail[state]][c];
+                queue[tail++] = s;
+            }
+        }
+    }
+
+    // The upper case letters go where the lower case ones do.
+    for (int state = 0; state < m->num_states; state++) {
+        for (int c = 'A'; c <= 'Z'; c++) {
+            m->next[state][c] = m->next[state][c - 'A' + 'a'];
+        }
+    }
+    free(fail);
+    free(queue);
+}
+
+/// @brief Builtin command: the keywords that are alerted.
+/// @param args "alerts" tells them, "alerts a, b" sets them, "alerts off"
+///             or "alerts \"\"" turns the alerts off.
+/// @return Always returns 1, to continue executing.
+int lsh_alerts(char **args)
+{
+  if (args[1] != NULL && args[2] == NULL
+      && (strcmp(args[1], "off") == 0 || strcmp(args[1], "\"\"") == 0)) {
+    alert_matcher_compile(&alerts, "");
+  } else if (args[1] != NULL) {
+    char *joined = join_args_with_space(args + 1);
+    alert_matcher_compile(&alerts, joined ? joined : "");
+    free(joined);
+  }
+
+  DynBuffer text;
+  dyn_buffer_init(&text);
+  if (alerts.num_keywords == 0) {
+    dyn_buffer_append(&text, "No alert keywords", 17);
+  }
+  for (int i = 0; i < alerts.num_keywords; i++) {
+    if (i > 0) {
+      dyn_buffer_append(&text, ", ", 2);
+    }
+    dyn_buffer_append(&text, alerts.keywords[i], strlen(alerts.keywords[i]));
+  }
+  printf("%s\n", text.data);
+  speak_audio(text.data);
+  dyn_buffer_free(&text);
+  return 1;
+}
+
+void alert_config_from_env(void) {
+    const char *list = getenv("PINA_ALERTS");
+    alert_matcher_compile(&alerts, list ? list : PINA_ALERTS_DEFAULT);
+}
+
+void alert_scan_init(AlertScan *scan) {
+    scan->state        = 0;
+    scan->line_alerted = 0;
+}
+
+///  @brief Scans a chunk of a stream for the keywords.
+///  @param offset Offset of the chunk in the text of the review output.
+///  @param on_match Called once per matching line, with the offset of the
+///         match in the review text and the keyword.
+void alert_scan(AlertScan *scan, const char *data, size_t len, size_t offset,
+                void (*on_match)(size_t offset, const char *keyword)) {
+    if (alerts.num_keywords == 0) {
+        return;
+    }
+    int (*next)[256] = alerts.next;
+    int state = scan->state;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = data[i];
+        state = next[state][c];
+        if (c == '\n') {
+            scan->line_alerted = 0;
+        } else if (alerts.keyword[state] >= 0 && !scan->line_alerted) {
+            scan->line_alerted = 1;
+            on_match(offset + i, alerts.keywords[alerts.keyword[state]]);
+        }
+    }
+    scan->state = state;
+}
+
+// ***************************************************************
+
+
+// ***************************************************************
+// Command statistics ( implementation ).
+//
+// The exit status, wall time and resource usage ( from wait4 ) of the last
+// PINA_STATS_MAX commands, queried with the stats builtin. After each
+// command the shell announces a failure, a wall time above a threshold and,
+// if enabled, the peak memory and CPU time. PINA_ANNOUNCE_STATUS=0|1,
+// PINA_ANNOUNCE_TIME=seconds ( 0 never ) and PINA_ANNOUNCE_USAGE=0|1 set
+// the defaults, the announce builtin changes them.
+
+#define PINA_STATS_MAX 100
+
+typedef struct CommandStats {
+    char   *command;
+    int     status;           // As from wait4().
+    double  wall_seconds;
+    double  cpu_user_seconds;
+    double  cpu_system_seconds;
+    long    max_rss_kb;
+    time_t  end_time;
+} CommandStats;
+
+CommandStats command_stats[PINA_STATS_MAX];   // Ring buffer.
+int          command_stats_newest = -1;
+int          command_stats_count  = 0;
+
+int    announce_status       = 1;
+double announce_time_seconds = 10.0;
+int    announce_usage        = 0;
+
+// Latency of Ctrl-C, from reading the SIGINT to the speech being silenced
+// and the command signalled, against the target of PINA_CANCEL_TARGET_MS.
+// When the command has the terminal the shell doesn't see the Ctrl-C, it
+// is from reaping the command that it killed to the speech being silenced.
+#define PINA_CANCEL_TARGET_MS 20.0
+
+double cancel_latency_last_ms = 0.0;
+double cancel_latency_max_ms  = 0.0;
+long   cancel_count           = 0;
+long   cancel_over_target     = 0;
+
+void stats_record_cancel(double latency_ms) {
+    cancel_latency_last_ms = latency_ms;
+    if (latency_ms > cancel_latency_max_ms) {
+        cancel_latency_max_ms = latency_ms;
+    }
+    cancel_count++;
+    if (latency_ms > PINA_CANCEL_TARGET_MS) {
+        cancel_over_target++;
+    }
+}
+
+void stats_config_from_env(void) {
+    const char *value;
+    if ((value = getenv("PINA_ANNOUNCE_STATUS")) != NULL) {
+        announce_status = atoi(value) != 0;
+    }
+    if ((value = getenv("PINA_ANNOUNCE_TIME")) != NULL) {
+        announce_time_seconds = atof(value);
+    }
+    if ((value = getenv("PINA_ANNOUNCE_USAGE")) != NULL) {
+        announce_usage = atoi(value) != 0;
+    }
+    if ((value = getenv("PINA_EARCONS")) != NULL) {
+        earcons_enabled = atoi(value) != 0;
+    }
+}
+
+double timeval_seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+///  @brief Records the statistics of a command that ended.
+CommandStats *stats_record(const char *command, int status, double wall_seconds,
+                           const struct rusage *usage) {
+    command_stats_newest = (command_stats_newest + 1) % PINA_STATS_MAX;
+    if (command_stats_count < PINA_STATS_MAX) {
+        command_stats_count++;
+    }
+
+    CommandStats *cs = &command_stats[command_stats_newest];
+    free(cs->command);
+    cs->command            = strdup(command ? command : "");
+    cs->status             = status;
+    cs->wall_seconds       = wall_seconds;
+    cs->cpu_user_seconds   = timeval_seconds(usage->ru_utime);
+    cs->cpu_system_seconds = timeval_seconds(usage->ru_stime);
+    cs->max_rss_kb         = usage->ru_maxrss;
+    cs->end_time           = time(NULL);
+    return cs;
+}
+
+// Get the statistics of age "age" ( 0 is the last command ), or NULL.
+CommandStats *stats_get(int age) {
+    if (age < 0 || age >= command_stats_count) {
+        return NULL;
+    }
+    return &command_stats[(command_stats_newest - age + PINA_STATS_MAX) % PINA_STATS_MAX];
+}
+
+// Writes how the command ended: "exit status 2", "killed by signal 9"...
+void stats_describe_status(const CommandStats *cs, char *text, size_t size) {
+    if (WIFSIGNALED(cs->status)) {
+        if (WTERMSIG(cs->status) == SIGINT) {
+            snprintf(text, size, "interrupted");
+        } else {
+            snprintf(text, size, "killed by signal %d, %s",
+                     WTERMSIG(cs->status), strsignal(WTERMSIG(cs->status)));
+        }
+    } else {
+        snprintf(text, size, "exit status %d", WEXITSTATUS(cs->status));
+    }
+}
+
+// Writes the whole statistics of a command, to be printed and spoken.
+void stats_describe(const CommandStats *cs, char *text, size_t size) {
+    char status[128];
+    stats_describe_status(cs, status, sizeof(status));
+    snprintf(text, size, "%s, %s, %.2f seconds, cpu %.2f seconds, peak memory %.1f megabytes",
+             cs->command, status, cs->wall_seconds,
+             cs->cpu_user_seconds + cs->cpu_system_seconds, cs->max_rss_kb / 1024.0);
+}
+
+///  @brief Speaks what the user asked to hear about a command that ended.
+void stats_announce(const CommandStats *cs) {
+    char text[512];
+    size_t len = 0;
+    text[0] = '\0';
+
+    int failed = WIFSIGNALED(cs->status) || WEXITSTATUS(cs->status) != 0;
+    if (announce_status && failed) {
+        stats_describe_status(cs, text, sizeof(text));
+        len = strlen(text);
+    }
+    if (announce_time_seconds > 0 && cs->wall_seconds >= announce_time_seconds) {
+        len += snprintf(text + len, sizeof(text) - len, "%stook %.1f seconds",
+                        len ? ", " : "", cs->wall_seconds);
+    }
+    if (announce_usage && len < sizeof(text)) {
+        snprintf(text + len, sizeof(text) - len, "%scpu %.1f seconds, peak memory %.0f megabytes",
+                 len ? ", " : "", cs->cpu_user_seconds + cs->cpu_system_seconds,
+                 cs->max_rss_kb / 1024.0);
+    }
+    speak_audio_priority(text, failed ? PINA_SPEECH_ERROR : PINA_SPEECH_PROMPT);
+}
+
+// ***************************************************************
+
+
+int FALSE = 0;
+int TRUE  = 1;
+
+int is_all_whitespace(char *str) {
+    while (*str) {
+        if (!isspace((unsigned char)*str))
+            return FALSE;
+        str++;
+    }
+    return TRUE;
+}
+
+// jnc end
+
+
+// ____________________________________________________________________________
+// Builtin function implementations.
+
+
+///  @brief Builtin command: change directory.
+///  @param args List of args.  args[0] is "cd".  args[1] is the directory.
+///  @return Always returns 1, to continue executing.
+int lsh_cd(char **args)
+{
+  if (args[1] == NULL) {
+    fprintf(stderr, "pina_shell: expected argument to \"cd\"\n");
+
+    // jnc inicio
+
+    speak_audio("pina_shell: expected argument to cd");
+    
+    // jnc fim
+
+  } else {
+    if (chdir(args[1]) != 0) {
+      perror("pina_shell");
+    }
+  }
+  return 1;
+}
+
+
+/// @brief Builtin command: print help.
+/// @param args List of args.  Not examined.
+/// @return Always returns 1, to continue executing.
+int lsh_help(char **args)
+{
+  int i;
+  printf("Joao Carvalho - pina_shell\n");
+  printf("Stephen Brennan's LSH\n");
+  printf("Type program names and arguments, and hit enter.\n");
+  printf("The following are built in:\n");
+
+  for (i = 0; i < lsh_num_builtins(); i++) {
+    printf("  %s\n", builtin_str[i]);
+  }
+
+  printf("stats [N | list | cancel] tells how the last commands ended, their time\n");
+  printf("and usage, or the latency of Ctrl-C.\n");
+  printf("announce [status on|off | time SECONDS | usage on|off | earcons on|off |\n");
+  printf("echo both|characters|words|silent] sets what is announced after each\n");
+  printf("command, the tones of the keys and the echo of the typed keys ( Alt-e\n");
+  printf("goes to the next echo, Alt-r reads the line typed so far ).\n");
+  printf("replay [list | N] [FILE] ( or review-session ) tells the commands recorded\n");
+  printf("in the session, and narrates the Nth one and puts it in the review keys.\n");
+  printf("A command gets the terminal and reads the keys: Ctrl-C interrupts it\n");
+  printf("and silences the speech. With no command Ctrl-C discards the line and\n");
+  printf("Ctrl-G only silences the speech. With PINA_TYPEAHEAD=1 the shell keeps\n");
+  printf("the keys: lines typed while a command runs are queued and run after it,\n");
+  printf("Ctrl-C pressed again terminates and then kills the command, and Ctrl-G\n");
+  printf("silences the speech and lets the command run.\n");
+  printf("Review keys, over the output of the last commands:\n");
+  printf("  Alt-7 / Alt-8 / Alt-9  previous / current / next line\n");
+  printf("  Alt-4 / Alt-5 / Alt-6  previous / current / next word\n");
+  printf("  Alt-1 / Alt-2 / Alt-3  previous / current / next character\n");
+  printf("  Alt-- / Alt-=          older / newer command output\n");
+  printf("  Alt-0                  next line with an alert keyword\n");
+  printf("  Alt-, / Alt-.          previous / next chunk of lines\n");
+  printf("  Alt-/                  size, first and last lines of the output\n");
+  printf("An output too large to be narrated is skimmed: at its end, its size and\n");
+  printf("its first and last lines are spoken ( PINA_SKIM_LINES ).\n");
+  printf("alerts [KEYWORD,KEYWORD,...] tells or sets the keywords alerted in outputs.\n");
+  printf("Alt-g speaks what the word before the cursor expands to, a glob as the\n");
+  printf("number of its matches. Simple commands are expanded and run without /bin/sh.\n");
+  printf("A command that isn't a builtin nor in $PATH is reported at once, with the\n");
+  printf("closest name.\n");
+  printf("Use the man command for information on other programs.\n");
+  return 1;
+}
+
+/// @brief Builtin command: statistics of the last commands.
+/// @param args "stats" speaks the last command, "stats N" the Nth last,
+///             "stats list" prints them all and "stats cancel" tells the
+///             latency of Ctrl-C.
+/// @return Always returns 1, to continue executing.
+int lsh_stats(char **args)
+{
+  char text[1024];
+
+  if (args[1] != NULL && strcmp(args[1], "cancel") == 0) {
+    snprintf(text, sizeof(text),
+             "%ld cancels, last %.1f milliseconds, max %.1f, %ld over the target of %.0f",
+             cancel_count, cancel_latency_last_ms, cancel_latency_max_ms,
+             cancel_over_target, PINA_CANCEL_TARGET_MS);
+    printf("%s\n", text);
+    speak_audio(text);
+    return 1;
+  }
+
+  if (command_stats_count == 0) {
+    printf("No command statistics yet.\n");
+    speak_audio("No command statistics yet.");
+    return 1;
+  }
+
+  if (args[1] != NULL && strcmp(args[1], "list") == 0) {
+    for (int age = command_stats_count - 1; age >= 0; age--) {
+      stats_describe(stats_get(age), text, sizeof(text));
+      printf(" %2d : %s\n", age + 1, text);
+    }
+    return 1;
+  }
+
+  int age = (args[1] != NULL) ? atoi(args[1]) - 1 : 0;
+  CommandStats *cs = stats_get(age);
+  if (cs == NULL) {
+    fprintf(stderr, "pina_shell: stats: no command %s\n", args[1]);
+    speak_audio("No such command");
+    return 1;
+  }
+  stats_describe(cs, text, sizeof(text));
+  printf("%s\n", text);
+  speak_audio(text);
+  return 1;
+}
+
+/// @brief Builtin command: what is announced after each command.
+/// @param args "announce status on|off", "announce time SECONDS" ( 0 never ),
+///             "announce usage on|off", "announce earcons on|off" or
+///             "announce echo both|characters|words|silent", without
+///             arguments prints them.
+/// @return Always returns 1, to continue executing.
+int lsh_announce(char **args)
+{
+  if (args[1] != NULL && args[2] != NULL) {
+    int on = strcmp(args[2], "on") == 0;
+    int is_switch = strcmp(args[1], "status") == 0 || strcmp(args[1], "usage") == 0
+                    || strcmp(args[1], "earcons") == 0;
+    if (is_switch && !on && strcmp(args[2], "off") != 0) {
+      fprintf(stderr, "pina_shell: announce: %s is on or off, not %s\n", args[1], args[2]);
+      speak_audio("On or off");
+      return 1;
+    }
+    if (strcmp(args[1], "status") == 0) {
+      announce_status = on;
+    } else if (strcmp(args[1], "usage") == 0) {
+      announce_usage = on;
+    } else if (strcmp(args[1], "time") == 0) {
+      announce_time_seconds = atof(args[2]);
+    } else if (strcmp(args[1], "earcons") == 0) {
+      earcons_enabled = on;
+    } else if (strcmp(args[1], "echo") == 0) {
+      if (echo_mode_from_name(args[2]) < 0) {
+        fprintf(stderr, "pina_shell: announce: unknown echo mode %s\n", args[2]);
+        speak_audio("Unknown echo mode");
+        return 1;
+      }
+      echo_mode = echo_mode_from_name(args[2]);
+    } else {
+      fprintf(stderr, "pina_shell: announce: unknown setting %s\n", args[1]);
+      speak_audio("Unknown setting");
+      return 1;
+    }
+  }
+
+  char text[256];
+  snprintf(text, sizeof(text), "status %s, time above %.1f seconds, usage %s, earcons %s, echo %s",
+           announce_status ? "on" : "off", announce_time_seconds,
+           announce_usage ? "on" : "off", earcons_enabled ? "on" : "off",
+           echo_mode_names[echo_mode]);
+  printf("%s\n", text);
+  speak_audio(text);
+  return 1;
+}
+
+/// @brief Builtin command: exit.
+/// @param args List of args.  Not examined.
+/// @return Always returns 0, to terminate execution.
+int lsh_exit(char **args)
+{
+  return 0;
+}
+
+// jnc begin
+
+///  @brief Writes to dest the context text followed by the src_len bytes of
+///         src, with each newline, tab and space replaced by its name.
+///  @return The length written to dest, that is null terminated. dest must
+///          have room for strlen(read_context_txt) + 9 * src_len + 1 bytes.
+size_t replace_newline_space_tab_with_char_name(const char *src, size_t src_len, char *dest, const char *read_context_txt) {
+    char *out = dest;
+
+    // Copy the context text to the destination (std out: \n or std err: \n).
+    size_t context_len = strlen(read_context_txt);
+    memcpy(out, read_context_txt, context_len);
+    out += context_len;
+
+    for (size_t i = 0; i < src_len; i++) {
+        const char *name;
+        switch (src[i]) {
+            case '\n': name = " newline "; break;
+            case '\t': name = " tab ";     break;
+            case ' ' : name = " space ";   break;
+            default:
+                *out++ = src[i];
+                continue;
+        }
+        size_t name_len = strlen(name);
+        memcpy(out, name, name_len);
+        out += name_len;
+    }
+    *out = '\0';
+    return out - dest;
+}
+
+// Allocates a destination for replace_newline_space_tab_with_char_name(),
+// large enough for the worst case where every byte becomes " newline ".
+char * alloc_char_name_buffer( size_t src_len, const char *read_context_txt ) {
+    char *dest = malloc(strlen(read_context_txt) + src_len * strlen(" newline ") + 1);
+    if (!dest) {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    return dest;
+}
+
+
+// ***************************************************************
+// Narrator ( implementation ).
+//
+// Turns a captured stream into the text to be spoken, line by line, so that
+// speech time follows the information in the output and not its size:
+//   - consecutive duplicate lines are spoken once, followed by
+//     "previous line repeated N times";
+//   - a line overwritten with '\r' ( progress bars ) is a status that is
+//     spoken at most once every PINA_STATUS_INTERVAL_SEC seconds, and its
+//     final state is always spoken.
+
+#define PINA_STATUS_INTERVAL_SEC 3.0
+
+// Longer lines are narrated in pieces of this size, so that an output
+// without newlines doesn't have to be held in memory.
+#define PINA_NARRATOR_MAX_LINE 4096
+
+typedef struct Narrator {
+    DynBuffer  out;              // Narration not yet taken by the speaker.
+    DynBuffer  line;             // The line being received.
+    char      *prev_line;        // The last line that was narrated.
+    int        repeat_count;     // Repetitions of prev_line not narrated yet.
+    int        pending_cr;       // Last byte was a '\r', the line may be a status.
+    char      *status;           // Last status that wasn't narrated, or NULL.
+    double     last_status_time; // When a status was last narrated, or < 0.
+} Narrator;
+
+void narrator_init(Narrator *n, const char *read_context_txt) {
+    dyn_buffer_init(&n->out);
+    dyn_buffer_init(&n->line);
+    n->prev_line        = NULL;
+    n->repeat_count     = 0;
+    n->pending_cr       = 0;
+    n->status           = NULL;
+    n->last_status_time = -1.0;
+    dyn_buffer_append(&n->out, read_context_txt, strlen(read_context_txt));
+}
+
+void narrator_free(Narrator *n) {
+    dyn_buffer_free(&n->out);
+    dyn_buffer_free(&n->line);
+    free(n->prev_line);
+    free(n->status);
+    n->prev_line = NULL;
+    n->status    = NULL;
+}
+
+// Appends the line, with its characters named, followed by " newline ".
+void narrator_append_line(Narrator *n, const char *line, size_t len) {
+    char *dest = alloc_char_name_buffer(len, "");
+    size_t dest_len = replace_newline_space_tab_with_char_name(line, len, dest, "");
+    dyn_buffer_append(&n->out, dest, dest_len);
+    dyn_buffer_append(&n->out, " newline ", strlen(" newline "));
+    free(dest);
+}
+
+void narrator_flush_repeats(Narrator *n) {
+    if (n->repeat_count > 0) {
+        char text[64];
+        snprintf(text, sizeof(text), "previous line repeated %d times newline ", n->repeat_count);
+        dyn_buffer_append(&n->out, text, strlen(text));
+        n->repeat_count = 0;
+    }
+}
+
+// Narrates a complete line, unless it repeats the previous one.
+void narrator_emit_line(Narrator *n, const char *line, size_t len) {
+    // Trailing white space doesn't make two lines different.
+    while (len > 0 && isspace((unsigned char) line[len - 1])) {
+        len--;
+    }
+
+    if (n->prev_line != NULL && strlen(n->prev_line) == len
+        && memcmp(n->prev_line, line, len) == 0) {
+        n->repeat_count++;
+        return;
+    }
+
+    narrator_flush_repeats(n);
+    narrator_append_line(n, line, len);
+    free(n->prev_line);
+    n->prev_line = strndup(line, len);
+}
+
+// Narrates the status that is waiting, if any ( its final state ).
+void narrator_flush_status(Narrator *n) {
+    if (n->status != NULL) {
+        narrator_emit_line(n, n->status, strlen(n->status));
+        free(n->status);
+        n->status = NULL;
+    }
+}
+
+// A line ended by '\r' will be overwritten: keep it as the current status
+// and narrate it only if the last status was narrated long enough ago.
+void narrator_emit_status(Narrator *n, const char *line, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    free(n->status);
+    n->status = strndup(line, len);
+
+    double now = monotonic_seconds();
+    if (n->last_status_time < 0 || now - n->last_status_time >= PINA_STATUS_INTERVAL_SEC) {
+        narrator_flush_status(n);
+        n->last_status_time = now;
+    }
+}
+
+///  @brief Feeds bytes of the captured stream to the narrator.
+void narrator_feed(Narrator *n, const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        char c = data[i];
+
+        if (n->pending_cr) {
+            n->pending_cr = 0;
+            if (c != '\n') {
+                // A lone '\r', the text that follows overwrites the line.
+                narrator_emit_status(n, n->line.data, n->line.len);
+                n->line.len = 0;
+            }
+        }
+
+        if (c == '\r') {
+            n->pending_cr = 1;
+        } else if (c == '\n') {
+            // A complete line ends the sequence of status updates.
+            if (n->line.len == 0 && n->status != NULL) {
+                narrator_flush_status(n);
+            } else {
+                free(n->status);
+                n->status = NULL;
+                narrator_emit_line(n, n->line.data ? n->line.data : "", n->line.len);
+            }
+            n->line.len = 0;
+        } else {
+            dyn_buffer_append(&n->line, &c, 1);
+            if (n->line.len >= PINA_NARRATOR_MAX_LINE) {
+                narrator_emit_line(n, n->line.data, n->line.len);
+                n->line.len = 0;
+            }
+        }
+    }
+}
+
+///  @brief Ends the stream: narrates the last line, status and repetitions.
+void narrator_finish(Narrator *n) {
+    if (n->pending_cr) {
+        n->pending_cr = 0;
+        narrator_emit_status(n, n->line.data, n->line.len);
+        n->line.len = 0;
+    }
+    if (n->line.len > 0) {
+        free(n->status);
+        n->status = NULL;
+        narrator_emit_line(n, n->line.data, n->line.len);
+        n->line.len = 0;
+    }
+    narrator_flush_status(n);
+    narrator_flush_repeats(n);
+}
+
+///  @brief Takes the narration produced so far ( the caller frees it ).
+///  @return The text, or NULL if there is nothing to speak.
+char * narrator_take(Narrator *n) {
+    if (n->out.len == 0) {
+        return NULL;
+    }
+    char *text = n->out.data;
+    dyn_buffer_init(&n->out);
+    return text;
+}
+
+// ***************************************************************
+
+// ***************************************************************
+// Session recording ( implementation ).
+//
+// Each command, its times, its exit status and its stdout and stderr are
+// appended to a session file, in blocks that are compressed one by one as
+// the output arrives, so that a long session costs little disk and CPU and
+// memory holds at most one block. An index file next to it, <session>.idx,
+// has one fixed size entry per command, so that the replay builtin jumps
+// to any command without reading the ones before.
+//
+// Recording is opt-in, the outputs may hold secrets: the session file is
+// the path in PINA_SESSION, or with PINA_SESSION=1 in interactive mode
+// $XDG_STATE_HOME/pina_shell/session-<date>-<pid>.pina ( ~/.local/state ),
+// where only the newest PINA_SESSION_KEEP sessions are kept. A session file
+// that grew past PINA_SESSION_MAX_MB is moved to <session>.1, replacing the
+// previous one, before the next command; the output of a command past that
+// size isn't recorded.
+//
+// Session file:  blocks of a SessionBlockHeader and stored_len bytes, that
+//                are deflated when method is 1. For each command:
+//                  COMMAND  the command line.
+//                  OUTPUT   records of a stream byte ( 1 stdout, 2 stderr ),
+//                           a uint32_t length and the bytes, in the order
+//                           they arrived.
+//                  END      nothing, the command is in the index.
+// Index file:    SessionIndexEntry records.
+
+#define PINA_SESSION_BLOCK (64 * 1024)
+#define PINA_SESSION_MAX_MB 64
+#define PINA_SESSION_KEEP   10
+
+#define PINA_SESSION_COMMAND 1
+#define PINA_SESSION_OUTPUT  2
+#define PINA_SESSION_END     3
+
+typedef struct SessionBlockHeader {
+    char     magic[4];        // "PSB1"
+    uint8_t  type;            // PINA_SESSION_COMMAND, _OUTPUT or _END.
+    uint8_t  method;          // 0 stored, 1 deflate.
+    uint16_t reserved;
+    uint32_t raw_len;
+    uint32_t stored_len;
+} SessionBlockHeader;
+
+typedef struct SessionIndexEntry {
+    uint64_t offset;          // Of the COMMAND block in the session file.
+    uint64_t output_bytes;
+    double   start_time;      // Seconds since the epoch.
+    double   wall_seconds;
+    int32_t  status;          // As given by waitpid().
+    uint32_t num_blocks;
+} SessionIndexEntry;
+
+int       session_fd         = -1;
+int       session_index_fd   = -1;
+char     *session_path       = NULL;
+off_t     session_size       = 0;
+off_t     session_max_bytes  = (off_t) PINA_SESSION_MAX_MB * 1024 * 1024;
+int       session_full       = 0;       // The command output is past the size.
+
+// The command being recorded.
+int               session_recording = 0;
+SessionIndexEntry session_entry;
+DynBuffer         session_pending;        // Output not compressed yet.
+int               session_pending_stream = 0;
+size_t            session_pending_record = 0;  // Offset of the record length.
+
+// Opens the session file at path and its index for appending.
+// Returns 0, or -1 with nothing open.
+int session_open_files(const char *path) {
+    char index_path[4096 + 8];
+    snprintf(index_path, sizeof(index_path), "%s.idx", path);
+    session_fd       = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    session_index_fd = open(index_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (session_fd < 0 || session_index_fd < 0) {
+        perror("pina_shell: session");
+        if (session_fd >= 0) {
+            close(session_fd);
+        }
+        if (session_index_fd >= 0) {
+            close(session_index_fd);
+        }
+        session_fd = session_index_fd = -1;
+        return -1;
+    }
+    session_size = lseek(session_fd, 0, SEEK_END);
+    if (session_size < 0) {
+        session_size = 0;
+    }
+    return 0;
+}
+
+int session_is_default_file(const struct dirent *entry) {
+    size_t len = strlen(entry->d_name);
+    return strncmp(entry->d_name, "session-", 8) == 0 && len > 5
+           && strcmp(entry->d_name + len - 5, ".pina") == 0;
+}
+
+// Deletes the oldest sessions of the default directory, so that with the
+// new one PINA_SESSION_KEEP are left.
+void session_prune(const char *dir) {
+    struct dirent **entries;
+    int count = scandir(dir, &entries, session_is_default_file, alphasort);
+    if (count < 0) {
+        return;
+    }
+    // The names start with the date, the oldest sort first.
+    for (int i = 0; i < count; i++) {
+        if (i < count - (PINA_SESSION_KEEP - 1)) {
+            const char *suffixes[] = { "", ".idx", ".1", ".1.idx" };
+            for (int k = 0; k < 4; k++) {
+                char path[4096];
+                snprintf(path, sizeof(path), "%s/%s%s", dir, entries[i]->d_name, suffixes[k]);
+                unlink(path);
+            }
+        }
+        free(entries[i]);
+    }
+    free(entries);
+}
+
+// Moves the session file and its index to <session>.1 and <session>.1.idx,
+// replacing the previous ones, and starts new ones.
+void session_rotate(void) {
+    char from[4096 + 8];
+    char to[4096 + 8];
+
+    close(session_fd);
+    close(session_index_fd);
+    snprintf(to, sizeof(to), "%s.1", session_path);
+    rename(session_path, to);
+    snprintf(from, sizeof(from), "%s.idx", session_path);
+    snprintf(to, sizeof(to), "%s.1.idx", session_path);
+    rename(from, to);
+    session_open_files(session_path);
+}
+
+///  @brief Opens the session file and its index for appending.
+///  @param default_on 1 to record to the default path with PINA_SESSION=1,
+///         in interactive mode.
+void session_open(int default_on) {
+    const char *path   = getenv("PINA_SESSION");
+    const char *max_mb = getenv("PINA_SESSION_MAX_MB");
+    char default_path[4096];
+
+    if (max_mb != NULL && atof(max_mb) > 0) {
+        session_max_bytes = (off_t) (atof(max_mb) * 1024 * 1024);
+    }
+    if (path == NULL || path[0] == '\0' || strcmp(path, "off") == 0 || strcmp(path, "0") == 0) {
+        return;
+    }
+    if (strcmp(path, "1") == 0 || strcmp(path, "on") == 0) {
+        if (!default_on) {
+            return;
+        }
+        const char *state = getenv("XDG_STATE_HOME");
+        const char *home  = getenv("HOME");
+        char dir[3072];
+        if (state != NULL && state[0] != '\0') {
+            snprintf(dir, sizeof(dir), "%s/pina_shell", state);
+        } else if (home != NULL) {
+            snprintf(dir, sizeof(dir), "%s/.local/state/pina_shell", home);
+        } else {
+            return;
+        }
+        // Creates the missing directories of the path.
+        for (char *slash = strchr(dir + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+            *slash = '\0';
+            mkdir(dir, 0700);
+            *slash = '/';
+        }
+        mkdir(dir, 0700);
+        session_prune(dir);
+
+        char date[32];
+        time_t now = time(NULL);
+        strftime(date, sizeof(date), "%Y%m%d-%H%M%S", localtime(&now));
+        snprintf(default_path, sizeof(default_path), "%s/session-%s-%d.pina",
+                 dir, date, (int) getpid());
+        path = default_path;
+    }
+
+    if (session_open_files(path) != 0) {
+        return;
+    }
+    session_path = strdup(path);
+    dyn_buffer_init(&session_pending);
+}
+
+// Writes all the len bytes, 0 on success.
+int session_write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p   += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Appends one block, deflated if that makes it smaller.
+void session_write_block(int type, const char *data, size_t len) {
+    SessionBlockHeader header;
+    memcpy(header.magic, "PSB1", 4);
+    header.type       = type;
+    header.method     = 0;
+    header.reserved   = 0;
+    header.raw_len    = len;
+    header.stored_len = len;
+
+    const char *stored = data;
+    char *compressed = NULL;
+#ifdef PINA_HAVE_ZLIB
+    if (len > 64) {
+        uLongf compressed_len = compressBound(len);
+        compressed = malloc(compressed_len);
+        if (compressed != NULL
+            && compress2((Bytef *) compressed, &compressed_len, (const Bytef *) data, len, Z_BEST_SPEED) == Z_OK
+            && compressed_len < len) {
+            header.method     = 1;
+            header.stored_len = compressed_len;
+            stored = compressed;
+        }
+    }
+#endif
+
+    // One write, so that a block is never split by a crash between the two.
+    char *block = malloc(sizeof(header) + header.stored_len);
+    if (!block) {
+        fprintf(stderr, "pina_shell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(block, &header, sizeof(header));
+    memcpy(block + sizeof(header), stored, header.stored_len);
+    if (session_write_all(session_fd, block, sizeof(header) + header.stored_len) != 0) {
+        perror("pina_shell: session");
+    } else {
+        session_size += sizeof(header) + header.stored_len;
+    }
+    free(block);
+    free(compressed);
+    session_entry.num_blocks++;
+}
+
+void session_flush_output(void) {
+    if (session_pending.len > 0) {
+        session_write_block(PINA_SESSION_OUTPUT, session_pending.data, session_pending.len);
+        session_pending.len    = 0;
+        session_pending_stream = 0;
+    }
+}
+
+///  @brief Starts recording a command.
+void session_begin_command(const char *command) {
+    if (session_fd >= 0 && session_size >= session_max_bytes) {
+        session_rotate();
+    }
+    if (session_fd < 0) {
+        return;
+    }
+    off_t offset = lseek(session_fd, 0, SEEK_END);
+    if (offset < 0) {
+        return;
+    }
+    memset(&session_entry, 0, sizeof(session_entry));
+    session_entry.offset = offset;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    session_entry.start_time = ts.tv_sec + ts.tv_nsec / 1e9;
+
+    session_pending.len    = 0;
+    session_pending_stream = 0;
+    session_recording      = 1;
+    session_full           = 0;
+    session_write_block(PINA_SESSION_COMMAND, command, strlen(command));
+}
+
+///  @brief Records output of the command.
+///  @param stream 1 for stdout, 2 for stderr.
+void session_append_output(int stream, const char *data, size_t len) {
+    if (!session_recording) {
+        return;
+    }
+    if (session_full || session_size + (off_t) (session_pending.len + len) > session_max_bytes) {
+        // The rest of the output of the command isn't recorded.
+        session_full = 1;
+        return;
+    }
+    session_entry.output_bytes += len;
+    while (len > 0) {
+        if (stream != session_pending_stream) {
+            // A new record: the stream, and the length, updated below.
+            char record[5] = { (char) stream, 0, 0, 0, 0 };
+            dyn_buffer_append(&session_pending, record, sizeof(record));
+            session_pending_stream = stream;
+            session_pending_record = session_pending.len - 4;
+        }
+        size_t room = PINA_SESSION_BLOCK > session_pending.len ? PINA_SESSION_BLOCK - session_pending.len : 0;
+        size_t n = len < room ? len : room;
+        dyn_buffer_append(&session_pending, data, n);
+
+        uint32_t record_len;
+        memcpy(&record_len, session_pending.data + session_pending_record, 4);
+        record_len += n;
+        memcpy(session_pending.data + session_pending_record, &record_len, 4);
+
+        data += n;
+        len  -= n;
+        if (session_pending.len >= PINA_SESSION_BLOCK) {
+            session_flush_output();
+        }
+    }
+}
+
+///  @brief Ends the command, and adds it to the index.
+void session_end_command(int status, double wall_seconds) {
+    if (!session_recording) {
+        return;
+    }
+    session_flush_output();
+    session_write_block(PINA_SESSION_END, NULL, 0);
+    session_entry.status       = status;
+    session_entry.wall_seconds = wall_seconds;
+    if (session_write_all(session_index_fd, &session_entry, sizeof(session_entry)) != 0) {
+        perror("pina_shell: session index");
+    }
+    session_recording = 0;
+}
+
+///  @brief Reads the block at *offset and advances it past the block.
+///  @return The raw data ( the caller frees it ), NULL at the end or if the
+///          block is damaged.
+char *session_read_block(int fd, off_t *offset, SessionBlockHeader *header) {
+    if (pread(fd, header, sizeof(*header), *offset) != (ssize_t) sizeof(*header)
+        || memcmp(header->magic, "PSB1", 4) != 0) {
+        return NULL;
+    }
+    char *stored = malloc(header->stored_len + 1);
+    char *raw    = malloc(header->raw_len + 1);
+    if (!stored || !raw) {
+        fprintf(stderr, "pina_shell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (pread(fd, stored, header->stored_len, *offset + sizeof(*header)) != (ssize_t) header->stored_len) {
+        free(stored);
+        free(raw);
+        return NULL;
+    }
+    *offset += sizeof(*header) + header->stored_len;
+
+    if (header->method == 0 && header->stored_len == header->raw_len) {
+        memcpy(raw, stored, header->raw_len);
+#ifdef PINA_HAVE_ZLIB
+    } else if (header->method == 1) {
+        uLongf raw_len = header->raw_len;
+        if (uncompress((Bytef *) raw, &raw_len, (const Bytef *) stored, header->stored_len) != Z_OK
+            || raw_len != header->raw_len) {
+            free(stored);
+            free(raw);
+            return NULL;
+        }
+#endif
+    } else {
+        free(stored);
+        free(raw);
+        return NULL;
+    }
+    free(stored);
+    raw[header->raw_len] = '\0';
+    return raw;
+}
+
+///  @brief Reads the index of a session.
+///  @return The entries ( the caller frees them ), NULL if there are none.
+SessionIndexEntry *session_read_index(const char *path, int *count) {
+    char index_path[4096 + 8];
+    snprintf(index_path, sizeof(index_path), "%s.idx", path);
+    *count = 0;
+
+    int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(SessionIndexEntry)) {
+        close(fd);
+        return NULL;
+    }
+    // An entry cut by a crash is ignored.
+    int n = st.st_size / sizeof(SessionIndexEntry);
+    SessionIndexEntry *entries = malloc(n * sizeof(SessionIndexEntry));
+    if (!entries) {
+        fprintf(stderr, "pina_shell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (pread(fd, entries, n * sizeof(SessionIndexEntry), 0) != (ssize_t) (n * sizeof(SessionIndexEntry))) {
+        free(entries);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+    *count = n;
+    return entries;
+}
+
+// Prints, narrates and puts in the review buffer one recorded command.
+void session_replay_command(int fd, SessionIndexEntry *entry, int number) {
+    off_t offset = entry->offset;
+    SessionBlockHeader header;
+    char *command = session_read_block(fd, &offset, &header);
+    if (command == NULL || header.type != PINA_SESSION_COMMAND) {
+        free(command);
+        printf("pina_shell: the session is damaged at command %d\n", number);
+        speak_audio("The session is damaged");
+        return;
+    }
+
+    char text[1024];
+    char when[32];
+    time_t start = (time_t) entry->start_time;
+    strftime(when, sizeof(when), "%H:%M:%S", localtime(&start));
+    int failed = WIFSIGNALED(entry->status) || WEXITSTATUS(entry->status) != 0;
+    snprintf(text, sizeof(text), "command %d, %.300s, at %s, %s, took %.1f seconds, %llu bytes of output",
+             number, command, when,
+             failed ? "failed" : "succeeded", entry->wall_seconds,
+             (unsigned long long) entry->output_bytes);
+    printf("%s\n", text);
+    speak_audio(text);
+
+    Narrator narrator__std_out, narrator__std_err;
+    narrator_init(&narrator__std_out, "stdout: \n");
+    narrator_init(&narrator__std_err, "stderr: \n");
+    ReviewOutput *out = review_begin_output(&review, command);
+    free(command);
+
+    char *raw;
+    while ((raw = session_read_block(fd, &offset, &header)) != NULL && header.type == PINA_SESSION_OUTPUT) {
+        size_t pos = 0;
+        while (pos + 5 <= header.raw_len) {
+            int stream = raw[pos];
+            uint32_t len;
+            memcpy(&len, raw + pos + 1, 4);
+            pos += 5;
+            if (len > header.raw_len - pos) {
+                break;
+            }
+            fwrite(raw + pos, 1, len, stream == 2 ? stderr : stdout);
+            narrator_feed(stream == 2 ? &narrator__std_err : &narrator__std_out, raw + pos, len);
+            review_output_append(out, raw + pos, len);
+            pos += len;
+        }
+        free(raw);
+
+        char *narration = narrator_take(&narrator__std_out);
+        speak_audio_priority(narration, PINA_SPEECH_NARRATION);
+        free(narration);
+        narration = narrator_take(&narrator__std_err);
+        speak_audio_priority(narration, PINA_SPEECH_ERROR);
+        free(narration);
+    }
+    free(raw);
+    fflush(stdout);
+
+    narrator_finish(&narrator__std_out);
+    narrator_finish(&narrator__std_err);
+    char *narration = narrator_take(&narrator__std_out);
+    speak_audio_priority(narration, PINA_SPEECH_NARRATION);
+    free(narration);
+    narration = narrator_take(&narrator__std_err);
+    speak_audio_priority(narration, PINA_SPEECH_ERROR);
+    free(narration);
+    narrator_free(&narrator__std_out);
+    narrator_free(&narrator__std_err);
+}
+
+/// @brief Builtin command: replays a recorded session.
+/// @param args "replay" tells how many commands were recorded, "replay list"
+///             prints them, "replay N" narrates the Nth command and puts its
+///             output in the review buffer. An optional last argument is
+///             another session file. Also named review-session.
+/// @return Always returns 1, to continue executing.
+int lsh_replay(char **args)
+{
+  const char *what = args[1];
+  const char *path = session_path;
+  char text[1024];
+
+  if (what != NULL && args[2] != NULL) {
+    path = args[2];
+  } else if (what != NULL && strcmp(what, "list") != 0 && !isdigit((unsigned char) what[0])) {
+    path = what;
+    what = NULL;
+  }
+  if (path == NULL) {
+    printf("The session isn't being recorded, see PINA_SESSION.\n");
+    speak_audio("The session isn't being recorded");
+    return 1;
+  }
+
+  int count;
+  SessionIndexEntry *entries = session_read_index(path, &count);
+  if (count == 0) {
+    printf("No commands recorded in %s\n", path);
+    speak_audio("No commands recorded");
+    return 1;
+  }
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    perror("pina_shell: replay");
+    free(entries);
+    return 1;
+  }
+
+  if (what == NULL) {
+    snprintf(text, sizeof(text), "%d commands recorded in %s", count, path);
+    printf("%s\n", text);
+    speak_audio(text);
+  } else if (strcmp(what, "list") == 0) {
+    for (int i = 0; i < count; i++) {
+      off_t offset = entries[i].offset;
+      SessionBlockHeader header;
+      char *command = session_read_block(fd, &offset, &header);
+      printf("%4d : %s%s\n", i + 1, command ? command : "?",
+             WIFSIGNALED(entries[i].status) || WEXITSTATUS(entries[i].status) != 0 ? "  ( failed )" : "");
+      free(command);
+    }
+    snprintf(text, sizeof(text), "%d commands", count);
+    speak_audio(text);
+  } else {
+    int n = atoi(what);
+    if (n < 1 || n > count) {
+      snprintf(text, sizeof(text), "No command %d, there are %d", n, count);
+      printf("%s\n", text);
+      speak_audio(text);
+    } else {
+      session_replay_command(fd, &entries[n - 1], n);
+    }
+  }
+
+  close(fd);
+  free(entries);
+  return 1;
+}
+
+// ***************************************************************
+
+
+
+char * join_args_with_space( char **args ) {
+    // Step 1: Calculate total length required
+    size_t total_len = 0;
+    for (int i = 0; args[i] != NULL; i++) {
+        total_len += strlen(args[i]) + 1;  // +1 for space or null terminator
+    }
+    if (total_len == 0) return NULL;
+
+    // Step 2: Allocate memory
+    char *result = malloc(total_len);
+    if (!result) {
         perror("Failed to allocate memory");
         exit(EXIT_FAILURE);
     }
 
-    // Step 3: Copy strings
-    char *dest = result;
-    for (int i = 0; args[i] != NULL; i++) {
-        if (i > 0) {
-            *dest++ = ' ';
+    // Step 3: Copy strings
+    char *dest = result;
+    for (int i = 0; args[i] != NULL; i++) {
+        if (i > 0) {
+            *dest++ = ' ';
+        }
+        size_t len = strlen(args[i]);
+        strncpy(dest, args[i], len);
+        dest += len;
+    }
+    *dest = '\0';
+
+    return result;
+}
+
+
+// ***************************************************************
+// Running command ( implementation ).
+//
+// A command launched with its output captured is the job: its stdout and
+// stderr pipes are read as data arrives, printed, narrated and kept in the
+// review buffer. The event loop reads them from its epoll and reaps the
+// child on SIGCHLD; without the event loop lsh_launch() drives the job
+// until it ends.
+
+typedef struct Job {
+    pid_t         pid;          // 0 when no command is running.
+    int           fd__std_out;  // -1 after EOF.
+    int           fd__std_err;
+    int           exited;       // The child was reaped.
+    int           status;
+    Narrator      narrator__std_out;
+    Narrator      narrator__std_err;
+    int           has_std_err;
+    ReviewOutput *review_output;
+    int           interrupts;   // Ctrl-C received while it runs.
+    int           skimming;     // The output is too large to be narrated.
+    AlertScan     alert_scan__std_out;
+    AlertScan     alert_scan__std_err;
+    int           num_alerts;
+    double        last_alert_time;
+    double        start_time;   // monotonic_seconds() at the launch.
+    double        wall_seconds;
+    struct rusage usage;
+} Job;
+
+Job job = { .fd__std_out = -1, .fd__std_err = -1 };
+
+// The epoll instance of the event loop, -1 when it isn't running.
+int loop_epoll_fd = -1;
+
+// The signals that the event loop receives through its signalfd, blocked
+// in the shell and unblocked again in the children.
+sigset_t loop_signals;
+
+// 0 in the script, -c and stdin modes: the output is written as is, the
+// narration is batched and nothing is spoken for the prompt.
+int interactive = 1;
+
+// 1 when the commands must not read the shell stdin ( the keyboard of the
+// event loop with type ahead, or the commands of the stdin mode ).
+int job_stdin_null = 0;
+
+// In the event loop each command runs in its own process group. With
+// job_takes_terminal that group is given the terminal, so that the command
+// reads the keyboard; with type ahead ( PINA_TYPEAHEAD=1 ) the shell keeps
+// the keyboard and queues the lines typed meanwhile.
+int job_own_group      = 0;
+int job_takes_terminal = 0;
+
+void loop_give_terminal(pid_t pgid);
+void loop_take_terminal(void);
+void loop_restore_terminal(void);
+void loop_apply_raw_terminal(void);
+
+// Exit status of the last command, 128 + the signal if it was killed.
+int last_exit_status = 0;
+
+int job_running(void) {
+    return job.pid > 0;
+}
+
+// Speaks the lines that the narrators completed so far.
+void job_speak_narration(void) {
+    char *narration = narrator_take(&job.narrator__std_out);
+    speak_audio_priority(narration, PINA_SPEECH_NARRATION);
+    free(narration);
+
+    if (job.has_std_err) {
+        narration = narrator_take(&job.narrator__std_err);
+        speak_audio_priority(narration, PINA_SPEECH_ERROR);
+        free(narration);
+    }
+}
+
+// A keyword matched in the output: bookmarks the line, and alerts now,
+// before the narration that is queued.
+void job_alert(size_t offset, const char *keyword) {
+    dyn_buffer_append(&job.review_output->bookmarks, (const char *) &offset, sizeof(offset));
+    job.num_alerts++;
+
+    double now = monotonic_seconds();
+    if (job.num_alerts > 1 && now - job.last_alert_time < PINA_ALERT_INTERVAL_SEC) {
+        return;
+    }
+    job.last_alert_time = now;
+    if (!earcon_play(PINA_EARCON_ALERT)) {
+        char text[256];
+        snprintf(text, sizeof(text), "alert, %.200s", keyword);
+        speak_audio_priority(text, PINA_SPEECH_ERROR);
+    }
+}
+
+// The output grew too large to be narrated: the stdout narration that is
+// left is dropped, and the command will end with the summary of the output.
+// The stderr is still narrated, the errors are few and they matter.
+void job_start_skimming(void) {
+    job.skimming = 1;
+    free(narrator_take(&job.narrator__std_out));
+    speech_cancel_narration();
+    speak_audio("long output, skimming");
+}
+
+///  @brief Stops watching one of the job pipes and closes it.
+void job_close_pipe(int *fd) {
+    if (*fd < 0) {
+        return;
+    }
+    if (loop_epoll_fd >= 0) {
+        epoll_ctl(loop_epoll_fd, EPOLL_CTL_DEL, *fd, NULL);
+    }
+    close(*fd);
+    *fd = -1;
+}
+
+///  @brief Reads what is available in one of the job pipes.
+///  @param fd The job.fd__std_out or job.fd__std_err, set to -1 at EOF.
+void job_read_pipe(int *fd) {
+    char buffer[1024 * 20];
+    int is_std_err = (fd == &job.fd__std_err);
+
+    ssize_t bytes_read = read(*fd, buffer, sizeof(buffer) - 1);
+    if (bytes_read < 0 && errno == EINTR) {
+        return;
+    }
+    if (bytes_read <= 0) {
+        // EOF or error, stop watching this pipe.
+        job_close_pipe(fd);
+        return;
+    }
+    buffer[bytes_read] = '\0';
+
+    if (!interactive) {
+        fwrite(buffer, 1, bytes_read, is_std_err ? stderr : stdout);
+    } else if (!is_std_err) {
+        printf("Parent read std out:\n%s", buffer);
+    } else {
+        printf("Parent read std error:\n%s", buffer);
+    }
+    fflush(is_std_err && !interactive ? stderr : stdout);
+
+    job.has_std_err |= is_std_err;
+    size_t review_offset = spill_buffer_len(&job.review_output->text);
+    review_output_append(job.review_output, buffer, bytes_read);
+    session_append_output(is_std_err ? 2 : 1, buffer, bytes_read);
+    alert_scan(is_std_err ? &job.alert_scan__std_err : &job.alert_scan__std_out,
+               buffer, bytes_read, review_offset, job_alert);
+
+    if (interactive && !job.skimming && skim_output_is_large(job.review_output)) {
+        job_start_skimming();
+    }
+    if (job.skimming && !is_std_err) {
+        return;
+    }
+    Narrator *narrator = is_std_err ? &job.narrator__std_err : &job.narrator__std_out;
+    narrator_feed(narrator, buffer, bytes_read);
+
+    // Executes other child forked process the espeak-ng to speak the
+    // stdout (ouput) and stdin (input) of the commando executable process.
+    // Without a user waiting at the keyboard, the narration is batched in
+    // one utterance per stream, unless it grows too large to hold.
+    if (interactive || narrator->out.len >= PINA_SPEECH_QUEUE_BYTES) {
+        job_speak_narration();
+    }
+}
+
+///  @brief Sends the signal to the command, to all the processes of its
+///         group ( the pipelines and the children of /bin/sh ) if it has
+///         one.
+void job_signal(int sig) {
+    kill(job_own_group ? -job.pid : job.pid, sig);
+}
+
+///  @brief Reaps the job child if it has exited.
+///  @param options 0 to wait for it, WNOHANG not to.
+void job_reap(int options) {
+    if (job_running() && !job.exited) {
+        pid_t pid;
+        do {
+            pid = wait4(job.pid, &job.status, options | (job_takes_terminal ? WUNTRACED : 0),
+                        &job.usage);
+        } while (pid == -1 && errno == EINTR);
+        if (pid == job.pid && (WIFEXITED(job.status) || WIFSIGNALED(job.status))) {
+            job.exited = 1;
+            job.wall_seconds = monotonic_seconds() - job.start_time;
+        } else if (pid == job.pid && WIFSTOPPED(job.status)) {
+            // Ctrl-Z: without job control to resume it later, the command
+            // would hold the terminal stopped, so it goes on.
+            job_signal(SIGCONT);
+            speak_audio("No job control, the command goes on");
+        } else if (pid == -1) {
+            job.exited = 1;
+            memset(&job.usage, 0, sizeof(job.usage));
+        }
+    }
+    if (job_running() && job.exited && job.interrupts >= 3) {
+        // Killed, don't wait for the processes it left holding the pipes.
+        job_close_pipe(&job.fd__std_out);
+        job_close_pipe(&job.fd__std_err);
+    }
+}
+
+int job_done(void) {
+    return job_running() && job.exited && job.fd__std_out < 0 && job.fd__std_err < 0;
+}
+
+///  @brief Narrates what is left of the output and forgets the job.
+void job_finish(void) {
+    if (WIFSIGNALED(job.status) && WTERMSIG(job.status) == SIGINT) {
+        // The command had the terminal, so the Ctrl-C that stopped it
+        // didn't reach the shell: it silences the rest of its output here.
+        speech_cancel();
+        if (job.interrupts == 0) {
+            stats_record_cancel((monotonic_seconds() - job.start_time - job.wall_seconds) * 1000.0);
+        }
+        printf("\n");
+    } else if (job.skimming) {
+        if (job.has_std_err) {
+            narrator_finish(&job.narrator__std_err);
+            job_speak_narration();
+        }
+        skim_speak_summary(job.review_output, PINA_SPEECH_PROMPT);
+        // Alt-. goes on after the first lines of the summary.
+        review_output_view(job.review_output);
+        if (review.cursor_age == 0 && review.cursor_pos == 0
+            && job.review_output->num_lines > PINA_SKIM_CONTEXT_LINES) {
+            review.cursor_pos  = job.review_output->line_start[PINA_SKIM_CONTEXT_LINES];
+            review.chunk_lines = 0;
+        }
+    } else {
+        narrator_finish(&job.narrator__std_out);
+        if (job.has_std_err) {
+            narrator_finish(&job.narrator__std_err);
+        }
+        job_speak_narration();
+    }
+
+    narrator_free(&job.narrator__std_out);
+    narrator_free(&job.narrator__std_err);
+
+    if (WIFSIGNALED(job.status)) {
+        last_exit_status = 128 + WTERMSIG(job.status);
+    } else {
+        last_exit_status = WEXITSTATUS(job.status);
+    }
+
+    session_end_command(job.status, job.wall_seconds);
+    if (job.num_alerts > 0) {
+        char text[128];
+        snprintf(text, sizeof(text), "%d %s, Alt-0 goes to %s", job.num_alerts,
+                 job.num_alerts == 1 ? "alert" : "alerts", job.num_alerts == 1 ? "it" : "them");
+        speak_audio_priority(text, PINA_SPEECH_ERROR);
+    }
+    if (interactive) {
+        earcon_play(last_exit_status != 0 ? PINA_EARCON_COMMAND_ERROR : PINA_EARCON_COMMAND_DONE);
+    }
+
+    CommandStats *cs = stats_record(job.review_output->command, job.status,
+                                    job.wall_seconds, &job.usage);
+    stats_announce(cs);
+    job.pid = 0;
+}
+
+// jnc end
+
+// ***************************************************************
+// Expansion ( implementation ).
+//
+// The shell expands the parameters ( $NAME, ${NAME}, $? and $$ ), the tilde
+// and the globs itself, so that a simple command is executed directly,
+// without a /bin/sh, and so that the preview key can tell what a word
+// expands to before running it. A line with quotes, pipes, redirections or
+// other shell syntax still goes to /bin/sh -c.
+//
+// The globs read the directories through a cache of their sorted listings,
+// that is refreshed when the mtime of the directory changes. A listing read
+// in the same second as the mtime may miss a later change in that second,
+// so it is read again the next time.
+
+#define PINA_DIR_CACHE_MAX 32
+
+typedef struct DirListing {
+    char           *path;        // NULL if the slot is free.
+    dev_t           dev;
+    ino_t           ino;
+    struct timespec mtime;
+    int             racy;        // Read in the second of the mtime.
+    char          **names;
+    int             count;
+    unsigned long   last_used;
+} DirListing;
+
+DirListing    dir_cache[PINA_DIR_CACHE_MAX];
+unsigned long dir_cache_clock  = 0;
+long          dir_cache_hits   = 0;
+long          dir_cache_misses = 0;
+
+// 1 while the line being executed can be expanded by the shell itself.
+int launch_line_is_simple = 0;
+
+// A growable array of words, null terminated like the args.
+typedef struct WordList {
+    char **words;
+    int    count;
+    int    capacity;
+} WordList;
+
+void word_list_init(WordList *wl) {
+    wl->words    = NULL;
+    wl->count    = 0;
+    wl->capacity = 0;
+}
+
+// Appends the word, that the list then owns.
+void word_list_add(WordList *wl, char *word) {
+    if (wl->count + 2 > wl->capacity) {
+        wl->capacity = wl->capacity ? wl->capacity * 2 : 16;
+        wl->words = realloc(wl->words, wl->capacity * sizeof(char *));
+        if (!wl->words) {
+            fprintf(stderr, "pina_shell: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    wl->words[wl->count++] = word;
+    wl->words[wl->count]   = NULL;
+}
+
+void word_list_free_words(char **words) {
+    if (words == NULL) {
+        return;
+    }
+    for (int i = 0; words[i] != NULL; i++) {
+        free(words[i]);
+    }
+    free(words);
+}
+
+static int dir_cache_compare_names(const void *a, const void *b) {
+    return strcoll(*(char * const *) a, *(char * const *) b);
+}
+
+void dir_listing_free(DirListing *dl) {
+    for (int i = 0; i < dl->count; i++) {
+        free(dl->names[i]);
+    }
+    free(dl->names);
+    free(dl->path);
+    memset(dl, 0, sizeof(*dl));
+}
+
+// Reads the sorted names of the directory, without "." and "..".
+int dir_listing_read(DirListing *dl, const char *path, struct stat *st) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+    WordList names;
+    word_list_init(&names);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            word_list_add(&names, strdup(entry->d_name));
+        }
+    }
+    closedir(dir);
+    qsort(names.words, names.count, sizeof(char *), dir_cache_compare_names);
+
+    dir_listing_free(dl);
+    dl->path  = strdup(path);
+    dl->dev   = st->st_dev;
+    dl->ino   = st->st_ino;
+    dl->mtime = st->st_mtim;
+    dl->racy  = st->st_mtim.tv_sec >= time(NULL) - 1;
+    dl->names = names.words;
+    dl->count = names.count;
+    return 0;
+}
+
+///  @brief The listing of a directory, from the cache while its mtime is
+///         the same, NULL if it can't be read.
+DirListing *dir_cache_get(const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+
+    DirListing *slot = NULL;
+    for (int i = 0; i < PINA_DIR_CACHE_MAX; i++) {
+        DirListing *dl = &dir_cache[i];
+        if (dl->path != NULL && strcmp(dl->path, path) == 0) {
+            slot = dl;
+            break;
+        }
+        if (slot == NULL || (slot->path != NULL && (dl->path == NULL || dl->last_used < slot->last_used))) {
+            // The first free slot, or else the least recently used.
+            slot = dl;
+        }
+    }
+
+    if (slot->path != NULL && strcmp(slot->path, path) == 0 && !slot->racy
+        && slot->dev == st.st_dev && slot->ino == st.st_ino
+        && slot->mtime.tv_sec == st.st_mtim.tv_sec && slot->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        dir_cache_hits++;
+    } else {
+        dir_cache_misses++;
+        if (dir_listing_read(slot, path, &st) != 0) {
+            return NULL;
+        }
+    }
+    slot->last_used = ++dir_cache_clock;
+    return slot;
+}
+
+int expand_has_glob(const char *word) {
+    return strpbrk(word, "*?[") != NULL;
+}
+
+///  @brief 1 if the line has only words, parameters, tildes and globs, that
+///         the shell expands itself, 0 if it needs /bin/sh.
+int expand_line_is_simple(const char *line) {
+    int word_start = 1, first_word = 1;
+    for (const char *p = line; *p; p++) {
+        if (strchr("|&;<>()`\\\"'", *p) != NULL) {
+            return 0;
+        }
+        if (*p == ' ' || *p == '\t' || *p == '\n') {
+            if (!word_start) {
+                first_word = 0;
+            }
+            word_start = 1;
+            continue;
+        }
+        if (word_start && (*p == '#' || (*p == '!' && (p[1] == '\0' || isspace((unsigned char) p[1]))))) {
+            return 0;
+        }
+        if (first_word && *p == '=') {
+            // An assignment, FOO=bar command.
+            return 0;
+        }
+        if (*p == '$') {
+            if (p[1] == '{') {
+                const char *q = p + 2;
+                while (isalnum((unsigned char) *q) || *q == '_') {
+                    q++;
+                }
+                if (q == p + 2 || *q != '}' || isdigit((unsigned char) p[2])) {
+                    return 0;
+                }
+            } else if (p[1] == '?' || p[1] == '$') {
+                p++;
+            } else if (!isalpha((unsigned char) p[1]) && p[1] != '_') {
+                return 0;
+            }
+        }
+        word_start = 0;
+    }
+    return 1;
+}
+
+// Joins a directory and a name of the glob.
+char *expand_join_path(const char *dir, const char *name, size_t name_len) {
+    size_t dir_len = strlen(dir);
+    int slash = dir_len > 0 && dir[dir_len - 1] != '/';
+    char *path = malloc(dir_len + slash + name_len + 1);
+    if (!path) {
+        fprintf(stderr, "pina_shell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(path, dir, dir_len);
+    if (slash) {
+        path[dir_len] = '/';
+    }
+    memcpy(path + dir_len + slash, name, name_len);
+    path[dir_len + slash + name_len] = '\0';
+    return path;
+}
+
+// Matches the components of the pattern in rest, from the directory dir
+// ( "" for the current one ), and adds the paths found to out.
+void expand_glob_from(const char *dir, const char *rest, WordList *out) {
+    while (*rest == '/') {
+        rest++;
+    }
+    const char *slash = strchr(rest, '/');
+    size_t comp_len = slash ? (size_t) (slash - rest) : strlen(rest);
+
+    if (comp_len == 0) {
+        // A trailing slash, only the directories match.
+        struct stat st;
+        if (stat(dir, &st) == 0 && S_ISDIR(st.st_mode)) {
+            word_list_add(out, expand_join_path(dir, "", 0));
+        }
+        return;
+    }
+
+    char component[comp_len + 1];
+    memcpy(component, rest, comp_len);
+    component[comp_len] = '\0';
+
+    if (!expand_has_glob(component)) {
+        char *path = expand_join_path(dir, component, comp_len);
+        struct stat st;
+        if (lstat(path, &st) == 0) {
+            if (slash) {
+                expand_glob_from(path, slash, out);
+            } else {
+                word_list_add(out, path);
+                return;
+            }
+        }
+        free(path);
+        return;
+    }
+
+    DirListing *dl = dir_cache_get(dir[0] ? dir : ".");
+    if (dl == NULL) {
+        return;
+    }
+    // The names are copied: the recursion may evict the listing.
+    int count = dl->count;
+    char **names = malloc((count + 1) * sizeof(char *));
+    if (!names) {
+        fprintf(stderr, "pina_shell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    int num_matches = 0;
+    for (int i = 0; i < count; i++) {
+        if (fnmatch(component, dl->names[i], FNM_PERIOD) == 0) {
+            names[num_matches++] = strdup(dl->names[i]);
+        }
+    }
+    for (int i = 0; i < num_matches; i++) {
+        char *path = expand_join_path(dir, names[i], strlen(names[i]));
+        if (slash) {
+            expand_glob_from(path, slash, out);
+            free(path);
+        } else {
+            word_list_add(out, path);
+        }
+        free(names[i]);
+    }
+    free(names);
+}
+
+// Expands the tilde at the start of the word, into buf.
+const char *expand_tilde(const char *word, DynBuffer *buf) {
+    if (word[0] != '~') {
+        return word;
+    }
+    size_t name_len = strcspn(word + 1, "/");
+    const char *home = NULL;
+    if (name_len == 0) {
+        home = getenv("HOME");
+        if (home == NULL) {
+            struct passwd *pw = getpwuid(getuid());
+            home = pw ? pw->pw_dir : NULL;
+        }
+    } else {
+        char name[name_len + 1];
+        memcpy(name, word + 1, name_len);
+        name[name_len] = '\0';
+        struct passwd *pw = getpwnam(name);
+        home = pw ? pw->pw_dir : NULL;
+    }
+    if (home == NULL) {
+        return word;
+    }
+    dyn_buffer_append(buf, home, strlen(home));
+    return word + 1 + name_len;
+}
+
+///  @brief Expands one word: the tilde, the parameters, whose values are
+///         split at the blanks, and the globs, a glob without matches
+///         stays as it is. Adds the resulting fields to out.
+void expand_word(const char *word, WordList *out) {
+    DynBuffer buf;
+    dyn_buffer_init(&buf);
+    int has_parameter = 0;
+
+    const char *p = expand_tilde(word, &buf);
+    while (*p) {
+        if (*p != '$') {
+            size_t len = strcspn(p, "$");
+            dyn_buffer_append(&buf, p, len);
+            p += len;
+            continue;
+        }
+        has_parameter = 1;
+        p++;
+        char value[32];
+        const char *text = NULL;
+        if (*p == '?' || *p == '$') {
+            snprintf(value, sizeof(value), "%d", *p == '?' ? last_exit_status : (int) getpid());
+            text = value;
+            p++;
+        } else {
+            int braces = (*p == '{');
+            const char *name = p + braces;
+            size_t name_len = 0;
+            while (isalnum((unsigned char) name[name_len]) || name[name_len] == '_') {
+                name_len++;
+            }
+            char name_str[name_len + 1];
+            memcpy(name_str, name, name_len);
+            name_str[name_len] = '\0';
+            text = getenv(name_str);
+            p = name + name_len + braces;
+        }
+        if (text != NULL) {
+            dyn_buffer_append(&buf, text, strlen(text));
+        }
+    }
+    const char *expanded = buf.data ? buf.data : "";
+
+    // The fields, the values of the parameters are split at the blanks.
+    WordList fields;
+    word_list_init(&fields);
+    if (has_parameter) {
+        const char *f = expanded;
+        while (*f) {
+            f += strspn(f, " \t\n");
+            size_t len = strcspn(f, " \t\n");
+            if (len > 0) {
+                word_list_add(&fields, strndup(f, len));
+            }
+            f += len;
+        }
+    } else {
+        word_list_add(&fields, strdup(expanded));
+    }
+    dyn_buffer_free(&buf);
+
+    for (int i = 0; i < fields.count; i++) {
+        int before = out->count;
+        if (expand_has_glob(fields.words[i])) {
+            const char *pattern = fields.words[i];
+            expand_glob_from(pattern[0] == '/' ? "/" : "", pattern, out);
+        }
+        if (out->count == before) {
+            word_list_add(out, fields.words[i]);
+        } else {
+            free(fields.words[i]);
+        }
+    }
+    free(fields.words);
+}
+
+///  @brief Expands all the words of a simple line.
+///  @return The expanded words, null terminated, free them with
+///          word_list_free_words().
+char **expand_words(char **args) {
+    WordList out;
+    word_list_init(&out);
+    for (int i = 0; args[i] != NULL; i++) {
+        expand_word(args[i], &out);
+    }
+    if (out.words == NULL) {
+        // No fields, like a line of only an unset $NAME.
+        out.words = calloc(1, sizeof(char *));
+        if (!out.words) {
+            fprintf(stderr, "pina_shell: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return out.words;
+}
+
+// ***************************************************************
+
+// ***************************************************************
+// Command lookup ( implementation ).
+//
+// Before launching, the first word of the line is looked up in the
+// builtins, the builtins and keywords of /bin/sh, and the directories of
+// $PATH, read through the directory cache. A command that isn't found is
+// reported at once, with the closest name by edit distance, without
+// forking a /bin/sh to find it out.
+
+// The builtins and keywords of /bin/sh, that aren't in $PATH.
+const char *lookup_sh_words[] = {
+    ".", ":", "[", "!", "{", "}", "alias", "bg", "break", "case", "command",
+    "continue", "do", "done", "echo", "elif", "else", "esac", "eval", "exec",
+    "exit", "export", "false", "fg", "fi", "for", "getopts", "hash", "if",
+    "jobs", "kill", "local", "printf", "pwd", "read", "readonly", "return",
+    "set", "shift", "source", "test", "then", "times", "trap", "true", "type",
+    "ulimit", "umask", "unalias", "unset", "until", "wait", "while"
+};
+
+#define LOOKUP_NUM_SH_WORDS ((int) (sizeof(lookup_sh_words) / sizeof(char *)))
+
+// Edit distance, with the transposition of two adjacent characters as one
+// edit ( "gti" is one edit from "git" ), stops early past max.
+int lookup_edit_distance(const char *a, const char *b, int max) {
+    int la = strlen(a), lb = strlen(b);
+    if (abs(la - lb) > max || la > 64 || lb > 64) {
+        return max + 1;
+    }
+    int d[65][65];
+    for (int i = 0; i <= la; i++) {
+        d[i][0] = i;
+    }
+    for (int j = 0; j <= lb; j++) {
+        d[0][j] = j;
+    }
+    for (int i = 1; i <= la; i++) {
+        int row_min = max + 1;
+        for (int j = 1; j <= lb; j++) {
+            int cost = (a[i - 1] == b[j - 1]) ? 0 : 1;
+            int best = d[i - 1][j - 1] + cost;
+            if (d[i - 1][j] + 1 < best) {
+                best = d[i - 1][j] + 1;
+            }
+            if (d[i][j - 1] + 1 < best) {
+                best = d[i][j - 1] + 1;
+            }
+            if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1]
+                && d[i - 2][j - 2] + 1 < best) {
+                best = d[i - 2][j - 2] + 1;
+            }
+            d[i][j] = best;
+            if (best < row_min) {
+                row_min = best;
+            }
+        }
+        if (row_min > max) {
+            return max + 1;
+        }
+    }
+    return d[la][lb];
+}
+
+// Keeps a copy of the name as the suggestion if it is closer than the best
+// so far, a later listing may evict the cache entry of this one.
+void lookup_consider(const char *name, const char *word, char **best, int *best_distance) {
+    int d = lookup_edit_distance(word, name, *best_distance - 1);
+    if (d < *best_distance) {
+        *best_distance = d;
+        free(*best);
+        *best = strdup(name);
+    }
+}
+
+// The next directory of the PATH list at *rest, "." for an empty one like
+// the shells, or NULL at its end. The caller frees it.
+char *lookup_next_path_dir(const char **rest) {
+    if (*rest == NULL) {
+        return NULL;
+    }
+    const char *end = strchr(*rest, ':');
+    size_t len = end != NULL ? (size_t) (end - *rest) : strlen(*rest);
+    char *dir = len > 0 ? strndup(*rest, len) : strdup(".");
+    if (!dir) {
+        fprintf(stderr, "pina_shell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    *rest = end != NULL ? end + 1 : NULL;
+    return dir;
+}
+
+///  @brief 1 if the command is a builtin, a word of /bin/sh or an
+///         executable, in $PATH if it has no slash.
+///  @param suggestion Set to a copy of the closest name when it isn't found,
+///         or NULL ( the caller frees it ).
+int lookup_command(const char *word, char **suggestion) {
+    *suggestion = NULL;
+
+    if (strchr(word, '/') != NULL) {
+        return access(word, X_OK) == 0;
+    }
+    for (int i = 0; i < lsh_num_builtins(); i++) {
+        if (strcmp(word, builtin_str[i]) == 0) {
+            return 1;
+        }
+    }
+    for (int i = 0; i < LOOKUP_NUM_SH_WORDS; i++) {
+        if (strcmp(word, lookup_sh_words[i]) == 0) {
+            return 1;
         }
-        size_t len = strlen(args[i]);
-        strncpy(dest, args[i], len);
-        dest += len;
     }
-    *dest = '\0';
 
-    return result;
+    const char *path_env = getenv("PATH");
+    const char *rest = path_env ? path_env : "/usr/bin:/bin";
+    char *dir;
+    while ((dir = lookup_next_path_dir(&rest)) != NULL) {
+        DirListing *dl = dir_cache_get(dir);
+        char **found = dl == NULL ? NULL
+                       : bsearch(&word, dl->names, dl->count, sizeof(char *), dir_cache_compare_names);
+        if (found != NULL) {
+            char *full = expand_join_path(dir, word, strlen(word));
+            int executable = access(full, X_OK) == 0;
+            free(full);
+            if (executable) {
+                free(dir);
+                return 1;
+            }
+        }
+        free(dir);
+    }
+
+    // Not found, the closest name, at most 2 edits and fewer than its length.
+    rest = path_env ? path_env : "/usr/bin:/bin";
+    int best_distance = strlen(word) < 3 ? (int) strlen(word) : 3;
+    for (int i = 0; i < lsh_num_builtins(); i++) {
+        lookup_consider(builtin_str[i], word, suggestion, &best_distance);
+    }
+    for (int i = 0; i < LOOKUP_NUM_SH_WORDS; i++) {
+        if (isalpha((unsigned char) lookup_sh_words[i][0])) {
+            lookup_consider(lookup_sh_words[i], word, suggestion, &best_distance);
+        }
+    }
+    while ((dir = lookup_next_path_dir(&rest)) != NULL) {
+        DirListing *dl = dir_cache_get(dir);
+        for (int i = 0; dl != NULL && i < dl->count; i++) {
+            lookup_consider(dl->names[i], word, suggestion, &best_distance);
+        }
+        free(dir);
+    }
+    return 0;
+}
+
+///  @brief Checks the command of the line before launching it.
+///  @return 1 to launch it, 0 if it isn't found: then it was reported,
+///          spoken, and $? is 127.
+int lookup_preflight(char **args) {
+    char *word = NULL;
+
+    if (launch_line_is_simple) {
+        WordList first;
+        word_list_init(&first);
+        expand_word(args[0], &first);
+        if (first.count > 0) {
+            word = strdup(first.words[0]);
+        }
+        word_list_free_words(first.words);
+    } else if (strpbrk(args[0], "|&;<>()`\\\"'$=*?[{}#~") == NULL) {
+        // The line needs /bin/sh, but starts with a plain command.
+        word = strdup(args[0]);
+    }
+    if (word == NULL) {
+        return 1;
+    }
+
+    char *suggestion;
+    int found = lookup_command(word, &suggestion);
+    if (!found) {
+        char text[512];
+        if (suggestion != NULL) {
+            snprintf(text, sizeof(text), "command not found: %.200s. Did you mean %.200s?",
+                     word, suggestion);
+        } else {
+            snprintf(text, sizeof(text), "command not found: %.200s", word);
+        }
+        fprintf(stderr, "pina_shell: %s\n", text);
+        speak_audio_priority(text, PINA_SPEECH_ERROR);
+        last_exit_status = 127;
+    }
+    free(suggestion);
+    free(word);
+    return found;
 }
 
+// ***************************************************************
 
-// jnc end
 
 
 ///  @brief Launch a program and wait for it to terminate.
 ///  @param args Null terminated list of arguments (including program).
+///  @param bool_int 1 to capture, print and speak its output.
 ///  @return Always returns 1, to continue execution.
 int lsh_launch(char **args, int bool_int)
 {
@@ -392,720 +5095,1757 @@ int lsh_launch(char **args, int bool_int)
   int pipe_fd__std_out[2];
   int pipe_fd__std_err[2];
 
-  if (bool_int == 1) {
-    if (pipe(pipe_fd__std_out) == -1 || pipe(pipe_fd__std_err) == -1) {
-      perror("pipe");
-      exit(EXIT_FAILURE);
+  if (bool_int == 1) {
+    // The read ends must not leak into the other children ( espeak-ng ).
+    if (pipe2(pipe_fd__std_out, O_CLOEXEC) == -1 || pipe2(pipe_fd__std_err, O_CLOEXEC) == -1) {
+      perror("pipe");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  char * command = join_args_with_space(args);
+
+  // A simple line is expanded here and executed without /bin/sh.
+  char **words = launch_line_is_simple ? expand_words(args) : NULL;
+  if (words != NULL && words[0] == NULL) {
+    word_list_free_words(words);
+    words = NULL;
+  }
+
+  if (bool_int == 1 && job_takes_terminal) {
+    // The command gets the terminal settings that the shell found.
+    loop_restore_terminal();
+  }
+// jnc end
+
+  pid = fork();
+  if (pid == 0) {
+
+// jnc begin
+      sigprocmask(SIG_UNBLOCK, &loop_signals, NULL);
+
+      if (bool_int == 1 && job_own_group) {
+        // Also here, so that the group exists before the command runs.
+        setpgid(0, 0);
+        if (job_takes_terminal) {
+          tcsetpgrp(STDIN_FILENO, getpid());
+        }
+      }
+      signal(SIGTTOU, SIG_DFL);
+      signal(SIGTTIN, SIG_DFL);
+
+      if (bool_int == 1) {
+        // std_out
+        close(pipe_fd__std_out[0]);
+        dup2(pipe_fd__std_out[1], STDOUT_FILENO);
+        close(pipe_fd__std_out[1]);
+
+        // std_err
+        close(pipe_fd__std_err[0]);
+        dup2(pipe_fd__std_err[1], STDERR_FILENO);
+        close(pipe_fd__std_err[1]);
+
+        if (job_stdin_null) {
+          // With type ahead the keyboard belongs to the shell while the
+          // command runs.
+          int fd_null = open("/dev/null", O_RDONLY);
+          if (fd_null >= 0) {
+            dup2(fd_null, STDIN_FILENO);
+            close(fd_null);
+          }
+        }
+    }
+// jnc fim
+
+
+      // IMPORTANT: I comment the following code so I could use the system call
+      //            that calls the shell program inside the shell.
+      //            This way I can already use the redirection with the pipes implemented
+      //            inside the bash shell.
+
+      // Child process
+
+      // if (execvp(args[0], args) == -1) {
+      //   perror("lsh");
+      // }
+
+
+      // Child process
+    
+// jnc begin
+
+      if (words != NULL) {
+          execvp(words[0], words);
+          // Not a program, maybe a builtin or a keyword of /bin/sh.
+          if (errno != ENOENT) {
+              fprintf(stderr, "pina_shell: %s: %s\n", words[0], strerror(errno));
+              _exit(126);
+          }
+      }
+
+      if (execl("/bin/sh", "sh", "-c", command, (char *) NULL) == -1) {
+          perror("execl");
+          exit(EXIT_FAILURE);
+      }
+
+// jnc end
+
+      exit(EXIT_FAILURE);
+  } else if (pid < 0) {
+      // Error forking
+      perror("pedro_pina");
+// jnc begin
+      if (bool_int == 1 && job_takes_terminal) {
+        loop_apply_raw_terminal();
+      }
+// jnc end
+  } else if (bool_int == 1) {
+      // Parent process
+
+// jnc begin
+      close(pipe_fd__std_out[1]);
+      close(pipe_fd__std_err[1]);
+
+      if (job_own_group) {
+        setpgid(pid, pid);
+        if (job_takes_terminal) {
+          loop_give_terminal(pid);
+        }
+      }
+
+      job.pid         = pid;
+      job.fd__std_out = pipe_fd__std_out[0];
+      job.fd__std_err = pipe_fd__std_err[0];
+      job.exited      = 0;
+      job.status      = 0;
+      job.interrupts  = 0;
+      job.skimming    = 0;
+      job.num_alerts  = 0;
+      alert_scan_init(&job.alert_scan__std_out);
+      alert_scan_init(&job.alert_scan__std_err);
+      job.start_time  = monotonic_seconds();
+      job.wall_seconds = 0;
+      memset(&job.usage, 0, sizeof(job.usage));
+      job.has_std_err = 0;
+      narrator_init(&job.narrator__std_out, "stdout: \n");
+      narrator_init(&job.narrator__std_err, "stderr: \n");
+
+      // Both streams, in arrival order, for the review buffer.
+      job.review_output = review_begin_output(&review, command);
+      session_begin_command(command);
+      if (interactive) {
+        earcon_play(PINA_EARCON_COMMAND_START);
+      }
+
+      if (loop_epoll_fd >= 0) {
+        // The event loop reads the pipes and reaps the child.
+        struct epoll_event ev;
+        ev.events  = EPOLLIN;
+        ev.data.fd = job.fd__std_out;
+        epoll_ctl(loop_epoll_fd, EPOLL_CTL_ADD, job.fd__std_out, &ev);
+        ev.data.fd = job.fd__std_err;
+        epoll_ctl(loop_epoll_fd, EPOLL_CTL_ADD, job.fd__std_err, &ev);
+      } else {
+        // Reads both pipes as data arrives, so that a child that fills the
+        // stderr pipe doesn't block while we wait for its stdout.
+        while (job.fd__std_out >= 0 || job.fd__std_err >= 0) {
+          struct pollfd fds[2];
+          fds[0].fd     = job.fd__std_out;
+          fds[0].events = POLLIN;
+          fds[1].fd     = job.fd__std_err;
+          fds[1].events = POLLIN;
+
+          if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+              continue;
+            }
+            perror("poll");
+            break;
+          }
+          if (fds[0].revents) {
+            job_read_pipe(&job.fd__std_out);
+          }
+          if (fds[1].revents) {
+            job_read_pipe(&job.fd__std_err);
+          }
+          speech_pump();
+        }
+        job_reap(0);
+        job_finish();
+      }
+// jnc end
+  } else {
+      // Parent process
+
+    do {
+      waitpid(pid, &status, WUNTRACED);
+    } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+  }
+
+// jnc begin
+  free(command);
+  word_list_free_words(words);
+// jnc end
+
+  return 1;
+}
+
+///  @brief Execute shell built-in or launch program.
+///  @param args Null terminated list of arguments.
+///  @return 1 if the shell should continue running, 0 if it should terminate
+int lsh_execute(char **args, int bool_int)
+{
+  int i;
+
+  if (args[0] == NULL) {
+    // An empty command was entered.
+    return 1;
+  }
+
+  for (i = 0; i < lsh_num_builtins(); i++) {
+    if (strcmp(args[0], builtin_str[i]) == 0) {
+// jnc begin
+      // The builtins get the expanded words too, cd ~/src.
+      char **words = launch_line_is_simple ? expand_words(args) : NULL;
+      int status = (*builtin_func[i])(words != NULL && words[0] != NULL ? words : args);
+      word_list_free_words(words);
+      return status;
+// jnc end
+    }
+  }
+
+// jnc begin
+  if (!lookup_preflight(args)) {
+    return 1;
+  }
+// jnc end
+
+  return lsh_launch(args, bool_int);
+}
+
+// jnc begin
+
+// ***************************************************************
+// Line editor ( implementation ).
+//
+// The line editor is fed the keys one byte at a time by the event loop, so
+// that the keyboard keeps working while a command runs or speech plays.
+
+#define LSH_RL_BUFSIZE 1024
+
+// Columns of the prompt, "pina_shell> ".
+#define LSH_PROMPT_COLUMNS 12
+
+LineEditor editor;
+
+// Makes room for size bytes in the buffer.
+void line_editor_reserve(LineEditor *ed, int size) {
+    if (size <= ed->bufsize) {
+        return;
+    }
+    while (ed->bufsize < size) {
+        ed->bufsize += LSH_RL_BUFSIZE;
+    }
+    ed->buffer = realloc(ed->buffer, ed->bufsize);
+    if (!ed->buffer) {
+        fprintf(stderr, "pina_shell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+///  @brief Starts a new, empty line.
+void line_editor_reset(LineEditor *ed) {
+    if (ed->buffer == NULL) {
+        ed->bufsize = 0;
+        line_editor_reserve(ed, LSH_RL_BUFSIZE);
+    }
+    ed->position             = 0;
+    ed->buffer[0]            = '\0';
+    ed->node_current         = NULL;
+    ed->flag_before_up_arrow = 1;
+    ed->escape_state         = 0;
+    ed->utf8_len             = 0;
+}
+
+// Screen column of the cursor when it is at the byte pos of the line.
+int line_editor_column(LineEditor *ed, int pos) {
+    return utf8_columns(ed->buffer, pos, LSH_PROMPT_COLUMNS);
+}
+
+// Inserts the len bytes of one code point typed by the user, and echoes it.
+void line_editor_insert(LineEditor *ed, const char *s, int len) {
+    line_editor_reserve(ed, ed->position + len + 2);
+    memcpy(ed->buffer + ed->position, s, len);
+    ed->position += len;
+    fwrite(s, 1, len, stdout);
+    echo_character(s, len);
+}
+
+///  @brief Takes the completed line ( the caller frees it ) and starts a new one.
+char *line_editor_take(LineEditor *ed) {
+    char *line = ed->buffer;
+    ed->buffer = NULL;
+    line_editor_reset(ed);
+    return line;
+}
+
+// Up and down arrows, c is 'A' or 'B': replaces the line with the next or
+// the previous command of the history.
+void line_editor_history(LineEditor *ed, int c) {
+    int flag_end_list = 0;
+
+    if (c == 'A') {
+        // UP ARROW
+
+        speak_earcon(PINA_EARCON_UP_ARROW, "up arrow");
+
+        if (ed->flag_before_up_arrow == 1) {
+            // Shows the current line, the most recent command.
+            ed->node_current = list_first( &list );
+            ed->flag_before_up_arrow = 0;
+        } else {
+            // Advances to the next line, that means one line up.
+
+            if (ed->node_current != NULL) {
+                Node * node_tmp = list_next( ed->node_current );
+
+                if (node_tmp == NULL) {
+                    // espeak-ng end list.
+                    speak_earcon(PINA_EARCON_END_LIST, "end list");
+                    flag_end_list = 1;
+                    // This is because the espeak-ng seams to be putting one
+                    // more character in the buffer.
+                    printf("\b");
+                    return;
+                } else {
+                    ed->node_current = node_tmp;
+                }
+            }
+        }
+    } else if (c == 'B') {
+        // DOWN ARROW
+
+        speak_earcon(PINA_EARCON_DOWN_ARROW, "down arrow");
+
+        if (ed->flag_before_up_arrow == 1) {
+            // Shows the current line.
+            return;
+        } else {
+            // Comes back to the previous line, that means one line down.
+
+            if (ed->node_current != NULL) {
+                Node * node_tmp = list_prev( ed->node_current );
+
+                if (node_tmp == NULL) {
+                    // espeak-ng end list.
+                    speak_earcon(PINA_EARCON_BEGIN_LIST, "begin list");
+                    flag_end_list = 1;
+                    // This is because the espeak-ng seams to be putting one
+                    // more character in the buffer.
+                    printf("\b");
+                    return;
+                } else {
+                    ed->node_current = node_tmp;
+                }
+            }
+        }
+    }
+
+    if (flag_end_list == 0 && ed->node_current != NULL) {
+        // Erases the previous line.
+
+        // Moves the cursor to the beginning of the line
+        // and writes over the line with spaces.
+        printf("\r%*s", line_editor_column(ed, ed->position) + 60, "");
+
+        char * my_str = (char *) ed->node_current->data;
+        // Put's the curor at the beginning of the line.
+        printf( "\rpina_shell> %s", my_str );
+        fflush( stdout );
+
+        // Copies the node_current->data to the buffer.
+        int len = strlen( my_str );
+        line_editor_reserve( ed, len + 1 );
+        memcpy( ed->buffer, my_str, len + 1 );
+        ed->position = len;
+
+        speak_echo( my_str );
+    }
+}
+
+// Alt-g: speaks what the word before the cursor expands to, for a glob the
+// number of matches and the first ones, without running anything.
+void line_editor_preview_expansion(LineEditor *ed) {
+    int start = ed->position;
+    while (start > 0 && ed->buffer[start - 1] != ' ' && ed->buffer[start - 1] != '\t') {
+        start--;
+    }
+    if (start == ed->position) {
+        speak_echo("No word to expand");
+        return;
+    }
+    char *word = strndup(ed->buffer + start, ed->position - start);
+
+    WordList out;
+    word_list_init(&out);
+    expand_word(word, &out);
+
+    char text[1024];
+    struct stat st;
+    if (expand_has_glob(word)) {
+        if (out.count == 1 && expand_has_glob(out.words[0]) && lstat(out.words[0], &st) != 0) {
+            snprintf(text, sizeof(text), "no matches");
+        } else {
+            size_t len = snprintf(text, sizeof(text), "%d %s", out.count,
+                                  out.count == 1 ? "match" : "matches");
+            for (int i = 0; i < out.count && i < 3 && len < sizeof(text); i++) {
+                len += snprintf(text + len, sizeof(text) - len, ", %.200s", out.words[i]);
+            }
+            if (out.count > 3 && len < sizeof(text)) {
+                snprintf(text + len, sizeof(text) - len, ", and %d more", out.count - 3);
+            }
+        }
+    } else if (out.count == 0) {
+        snprintf(text, sizeof(text), "expands to nothing");
+    } else {
+        char *joined = join_args_with_space(out.words);
+        snprintf(text, sizeof(text), "expands to %.900s", joined);
+        free(joined);
+    }
+    speak_echo(text);
+
+    word_list_free_words(out.words);
+    free(word);
+}
+
+///  @brief In the words echo mode, speaks the word that ends at end, the
+///         space or the Enter that was just typed.
+void line_editor_speak_word(LineEditor *ed, int end) {
+    char *buffer = ed->buffer;
+    if (!(echo_mode & PINA_ECHO_WORDS)
+        || end <= 0 || buffer[end - 1] == ' ' || buffer[end - 1] == '\t') {
+        return;
+    }
+
+    // Find the beginning of the last word.
+    int start = end;
+    while (start > 0 && buffer[start - 1] != ' ' && buffer[start - 1] != '\t') {
+        start--;
+    }
+
+    // Copy the last word to a null terminated buffer.
+    char last_word_buffer[300] = {0};
+    int len = end - start < (int) sizeof(last_word_buffer) - 1
+        ? end - start : (int) sizeof(last_word_buffer) - 1;
+    memcpy(last_word_buffer, &buffer[start], len);
+
+    speak_echo( last_word_buffer );
+}
+
+///  @brief Feeds one key byte typed by the user to the line editor.
+///  @param c The byte.
+///  @return 1 when the line is complete ( Enter ) in ed->buffer, 0 otherwise.
+int line_editor_feed(LineEditor *ed, int c) {
+    char *buffer = ed->buffer;
+
+    if (ed->escape_state == 1) {
+        ed->escape_state = 0;
+        if ( c == 'g' ) {
+            line_editor_preview_expansion(ed);
+            return 0;
+        }
+        if ( c == 'e' ) {
+            echo_mode_next();
+            return 0;
+        }
+        if ( c == 'r' ) {
+            // Reads back the line, the echo of the silent mode.
+            buffer[ed->position] = '\0';
+            speak_echo(ed->position > 0 ? buffer : "Empty line");
+            return 0;
+        }
+        if ( review_handle_key( &review, c ) ) {
+            // Alt + key of the review cursor, over the last outputs.
+            return 0;
+        }
+        if ( c != '[' ) {
+            // It's not the up or down arrows characters.
+            printf("%c", c );
+            return 0;
+        }
+        ed->escape_state = 2;
+        return 0;
+    }
+
+    if (ed->escape_state == 2) {
+        ed->escape_state = 0;
+        if ( c != 'A' && c != 'B' ) {
+            // It's not the up or down arrows characters.
+            printf("%c", c );
+            return 0;
+        }
+        printf(" ");
+        line_editor_history(ed, c);
+        return 0;
     }
-  }
-// jnc end
 
-  pid = fork();
-  if (pid == 0) {
+    if (ed->utf8_len > 0) {
+        if (utf8_is_continuation((unsigned char) c)) {
+            // The next byte of a code point, inserted when complete.
+            ed->utf8_pending[ed->utf8_len++] = c;
+            if (ed->utf8_len == utf8_sequence_length((unsigned char) ed->utf8_pending[0])) {
+                // An overlong encoding or a surrogate is dropped.
+                uint32_t cp;
+                if (utf8_decode(ed->utf8_pending, ed->utf8_len, &cp) > 0) {
+                    line_editor_insert(ed, ed->utf8_pending, ed->utf8_len);
+                }
+                ed->utf8_len = 0;
+                fflush(stdout);
+                ed->buffer[ed->position] = '\0';
+            }
+            return 0;
+        }
+        // Truncated code point, dropped.
+        ed->utf8_len = 0;
+    }
 
-// jnc begin
-      if (bool_int == 1) {
-        // std_out
-        close(pipe_fd__std_out[0]);
-        dup2(pipe_fd__std_out[1], STDOUT_FILENO);
-        close(pipe_fd__std_out[1]);
+    // Speak the character
+    switch (c)
+    {
+      case '\n':
+        buffer[ed->position] = '\0';
+        printf("\n");
+        line_editor_speak_word(ed, ed->position);
+        return 1;
+      case 0x07:
+        // Ctrl-G silences the speech.
+        speech_cancel();
+        break;
+      case ' ':
+        buffer[ed->position] = c;
+        ed->position++;
+        printf("%c", c);
+        echo_earcon(PINA_EARCON_SPACE, "space", echo_mode & PINA_ECHO_CHARACTERS);
+
+        line_editor_speak_word(ed, ed->position - 1);
+        break;
+      case '\t':
+        buffer[ed->position] = c;
+        ed->position++;
+        printf("%c", c);
+        echo_earcon(PINA_EARCON_TAB, "tab", echo_mode & PINA_ECHO_CHARACTERS);
+        break;
+      case '\b':
+      case 127:  // 127 The ASCII para backspace DEL in same terminal's shell.
+        // What is erased is told in every mode but silent.
+        echo_earcon(PINA_EARCON_BACKSPACE, "backspace", echo_mode != PINA_ECHO_SILENT);
+
+        if (ed->position > 0) {
+          // The whole code point before the cursor, over all its columns.
+          int start   = (int) utf8_prev(buffer, ed->position);
+          int columns = line_editor_column(ed, ed->position) - line_editor_column(ed, start);
+
+          if (buffer[start] == '\t') {  // backspace em tab.
+              echo_earcon( PINA_EARCON_TAB, "tab", echo_mode != PINA_ECHO_SILENT );
+          } else if (buffer[start] == ' ') {  // backspace with space.
+              echo_earcon( PINA_EARCON_SPACE, "space", echo_mode != PINA_ECHO_SILENT );
+          } else if (echo_mode != PINA_ECHO_SILENT) {
+              speak_code_point( &buffer[start], ed->position - start );
+          }
 
-        // std_err
-        close(pipe_fd__std_err[0]);
-        dup2(pipe_fd__std_err[1], STDERR_FILENO);
-        close(pipe_fd__std_err[1]);
+          // Has to do backspace, then print of spaces to erase the
+          // character that is on the screen e then backspace again.
+          printf("%.*s%*s%.*s", columns, "\b\b\b\b\b\b\b\b", columns, "",
+                 columns, "\b\b\b\b\b\b\b\b");
+
+          ed->position = start;
+          buffer[ed->position] = '\0';
+          // And also doesn't increment the position variable because the
+          // character has been erased and the current is a erasing character
+        } else if (echo_mode != PINA_ECHO_SILENT) {
+          speak_echo("Empty line");
+        }
+        break;
+      case 0x1B:
+        // Escape character  0x1B '[' 'A'   // 'A' - UP Arrow and 'B' - DOWN Arrow
+        ed->escape_state = 1;
+        break;
+      default:
+        if (c >= 0x80) {
+            // The first byte of a code point, a stray byte is dropped.
+            if (utf8_sequence_length((unsigned char) c) > 1) {
+                ed->utf8_pending[0] = c;
+                ed->utf8_len = 1;
+            }
+            break;
+        }
+        buffer[ed->position] = c;
+        ed->position++;
+        printf("%c", c);
+
+        char char_str_2[2];
+        char_str_2[0] = c;
+        char_str_2[1] = '\0';
+        echo_character( char_str_2, 1 );
+        break;
     }
-// jnc fim
 
+    fflush(stdout);
 
-      // IMPORTANT: I comment the following code so I could use the system call
-      //            that calls the shell program inside the shell.
-      //            This way I can already use the redirection with the pipes implemented
-      //            inside the bash shell.
+    // If we have exceeded the buffer, reallocate ( one byte is kept for the
+    // null terminator ).
+    line_editor_reserve(ed, ed->position + 2);
+    ed->buffer[ed->position] = '\0';
+    return 0;
+}
 
-      // Child process
+// ***************************************************************
 
-      // if (execvp(args[0], args) == -1) {
-      //   perror("lsh");
-      // }
+// jnc end
 
+#define LSH_TOK_BUFSIZE 64
+#define LSH_TOK_DELIM " \t\r\n\a"
 
-      // Child process
-    
-// jnc begin
+///  @brief Split a line into tokens (very naively).
+///  @param line The line.
+///  @return Null-terminated array of tokens.
+ 
+
+/*
+char **lsh_split_line(char *line)
+{
+  int bufsize = LSH_TOK_BUFSIZE, position = 0;
+  char **tokens = malloc(bufsize * sizeof(char*));
+  char *token, **tokens_backup;
 
-      char * command = join_args_with_space(args);
+  if (!tokens) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
 
-      if (execl("/bin/sh", "sh", "-c", command, (char *) NULL) == -1) {
-          perror("execl");
+  token = strtok(line, LSH_TOK_DELIM);
+  while (token != NULL) {
+    tokens[position] = token;
+    position++;
+
+    if (position >= bufsize) {
+      bufsize += LSH_TOK_BUFSIZE;
+      tokens_backup = tokens;
+      tokens = realloc(tokens, bufsize * sizeof(char*));
+      if (!tokens) {
+		      free(tokens_backup);
+          fprintf(stderr, "lsh: allocation error\n");
           exit(EXIT_FAILURE);
       }
+    }
+
+    token = strtok(NULL, LSH_TOK_DELIM);
+  }
+  tokens[position] = NULL;
+  return tokens;
+}
 
-      free( command );
+*/
 
-// jnc end
 
-      exit(EXIT_FAILURE);
-  } else if (pid < 0) {
-      // Error forking
-      perror("pedro_pina");
-  } else {
-      // Parent process
 
 // jnc begin
-      if (bool_int == 1) {
-    
-        // std_out
-        char buffer__std_out[1024 * 20];
-        ssize_t bytes_read__std_out;
-      
-        // std_err
-        char buffer__std_err[1024 * 20];
-        ssize_t bytes_read__std_err;
 
-        close(pipe_fd__std_out[1]);
-        close(pipe_fd__std_err[1]);
+char **lsh_split_line(char *line) {
+    int bufsize = LSH_TOK_BUFSIZE, position = 0;
+    char **tokens = malloc(bufsize * sizeof(char*));
+    if (!tokens) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
 
-        // std_out
-        while ((bytes_read__std_out = read(pipe_fd__std_out[0], buffer__std_out, sizeof(buffer__std_out) - 1)) > 0) {
-            buffer__std_out[bytes_read__std_out] = '\0';
-            printf("Parent read std out:\n%s", buffer__std_out);
+    char *start = line, *end = line;
+    while (*end) {
+        // Skip whitespace
+        while (*end && strchr(LSH_TOK_DELIM, *end)) {
+            end++;
         }
+        start = end;
 
-        // std_err
-        while ((bytes_read__std_err = read(pipe_fd__std_err[0], buffer__std_err, sizeof(buffer__std_err) - 1)) > 0) {
-            buffer__std_err[bytes_read__std_err] = '\0';
-            printf("Parent read std error:\n%s", buffer__std_err);
+        // Handle quoted strings
+        if (*end == '"') {
+            start++;  // move past the starting quote
+            end++;
+            while (*end && *end != '"') {
+                end++;
+            }
+            if (*end) {
+                tokens[position] = strndup(start, end - start);
+                end++;  // skip the ending quote
+            } else {
+                tokens[position] = strdup(start);  // unmatched quote, copy the rest
+            }
+        } else {
+            // Find the next delimiter
+            while (*end && !strchr(LSH_TOK_DELIM, *end) && *end != '"') {
+                end++;
+            }
+            tokens[position] = strndup(start, end - start);
         }
 
-        close(pipe_fd__std_out[0]);
-        close(pipe_fd__std_err[0]);
-    
-
-        char buffer_clone_replaced__std_out[10000] = {0};
-        char buffer_clone_replaced__std_err[10000] = {0};
-
-        char * read_context_txt;
-      
-        if (buffer__std_err != '\0' ) {
-            read_context_txt = "stdout: \n";
-            replace_newline_space_tab_with_char_name( buffer__std_out, buffer_clone_replaced__std_out, read_context_txt );
-            
-            // debug
-            // printf("=>debug: %s\n", buffer_clone_replaced__std_out);
+        if (!tokens[position]) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
         }
+        position++;
 
-        if (buffer__std_err[0] != '\0' ) {
-            read_context_txt = "stderr: \n";
-            replace_newline_space_tab_with_char_name( buffer__std_err, buffer_clone_replaced__std_err, read_context_txt );
-
-            // debug
-            // printf("=>debug: %s\n", buffer_clone_replaced__std_err);
+        if (position >= bufsize) {
+            bufsize += LSH_TOK_BUFSIZE;
+            tokens = realloc(tokens, bufsize * sizeof(char*));
+            if (!tokens) {
+                fprintf(stderr, "lsh: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
         }
+    }
+    tokens[position] = NULL;
+    return tokens;
+}
 
-        // printf("%s", buffer_clone_replaced);
-
-        // Executes other child forked process the espeak-ng to speak the
-        // stdout (ouput) and stdin (input) of the commando executable process.
-        // The father captured the child process.
-        
-        speak_audio( buffer_clone_replaced__std_out );
 
-        speak_audio( buffer_clone_replaced__std_err );
-    }
 // jnc end
 
 
-    do {
-      waitpid(pid, &status, WUNTRACED);
-    } while (!WIFEXITED(status) && !WIFSIGNALED(status));
-  }
 
-  return 1;
+// jnc begin
+
+// ***************************************************************
+// Event loop ( implementation ).
+//
+// One epoll multiplexes the keyboard, the stdout and stderr pipes of the
+// running command and the signals ( SIGINT and SIGCHLD, via a signalfd ).
+// SIGCHLD reaps the command and tells the speech queue that an espeak-ng
+// utterance ended. The keyboard is not watched while the command has the
+// terminal; with type ahead ( PINA_TYPEAHEAD=1 ) the lines typed while a
+// command runs are queued and run after it.
+
+struct termios loop_saved_termios;
+struct termios loop_raw_termios;
+int loop_has_termios = 0;
+
+// Lines typed ahead while a command was running, the oldest at the tail.
+LinkedList pending_lines;
+
+void loop_restore_terminal(void) {
+    if (loop_has_termios) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &loop_saved_termios);
+    }
 }
 
-///  @brief Execute shell built-in or launch program.
-///  @param args Null terminated list of arguments.
-///  @return 1 if the shell should continue running, 0 if it should terminate
-int lsh_execute(char **args, int bool_int)
-{
-  int i;
+// Puts back the settings of the shell, that a command using /dev/tty may
+// have changed before being killed.
+void loop_apply_raw_terminal(void) {
+    if (loop_has_termios) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &loop_raw_termios);
+    }
+}
 
-  if (args[0] == NULL) {
-    // An empty command was entered.
-    return 1;
-  }
+// stdin is watched by the epoll of the event loop.
+int loop_stdin_watched = 0;
 
-  for (i = 0; i < lsh_num_builtins(); i++) {
-    if (strcmp(args[0], builtin_str[i]) == 0) {
-      return (*builtin_func[i])(args);
+///  @brief Gives the terminal to the process group of the command: the
+///         keyboard is its own until it ends.
+void loop_give_terminal(pid_t pgid) {
+    tcsetpgrp(STDIN_FILENO, pgid);
+    if (loop_stdin_watched) {
+        epoll_ctl(loop_epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
     }
-  }
+}
 
-  return lsh_launch(args, bool_int);
+///  @brief Takes the terminal back from the command that ended, in the
+///         settings of the shell.
+void loop_take_terminal(void) {
+    if (job_takes_terminal) {
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+        if (loop_stdin_watched) {
+            struct epoll_event ev;
+            ev.events  = EPOLLIN;
+            ev.data.fd = STDIN_FILENO;
+            epoll_ctl(loop_epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev);
+        }
+    }
+    loop_apply_raw_terminal();
 }
 
-///  @brief Read a line of input from stdin.
-///  @return The line from stdin.
-char *lsh_read_line(void)
-{
-/*
-#ifdef LSH_USE_STD_GETLINE
-  char *line = NULL;
-  ssize_t bufsize = 0; // have getline allocate a buffer for us
-  if (getline(&line, &bufsize, stdin) == -1) {
-    if (feof(stdin)) {
-      exit(EXIT_SUCCESS);  // We received an EOF
-    } else  {
-      perror("lsh: getline\n");
-      exit(EXIT_FAILURE);
+// A crash must not leave the terminal without echo.
+void loop_fatal_signal_handler(int sig) {
+    loop_restore_terminal();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+///  @brief Ctrl-C: interrupts the command, or silences the speech, or
+///         discards the line being typed, while keeping the shell alive.
+///         Repeated Ctrl-C on a command that doesn't stop escalate to
+///         SIGTERM and then SIGKILL.
+///         With the terminal given to the command, Ctrl-C goes to the
+///         command and this only runs for a kill -INT of the shell.
+void loop_interrupt(void) {
+    double start = monotonic_seconds();
+    int was_speaking = speech_active();
+
+    speech_cancel();
+
+    if (job_running()) {
+        job.interrupts++;
+        if (job.interrupts >= 3) {
+            job_signal(SIGKILL);
+        } else if (job.interrupts == 2) {
+            job_signal(SIGTERM);
+        } else {
+            job_signal(SIGINT);
+        }
+        job_reap(WNOHANG);
+    } else if (!was_speaking) {
+        line_editor_reset(&editor);
+        printf("^C\npina_shell> ");
+        fflush(stdout);
     }
-  }
-  return line;
-#else
-*/
-#define LSH_RL_BUFSIZE 1024
 
+    stats_record_cancel((monotonic_seconds() - start) * 1000.0);
+}
 
-  int bufsize = LSH_RL_BUFSIZE;
-  int position = 0;
-  char *buffer = malloc(sizeof(char) * bufsize);
-  int c;
+// Ctrl-Z: gives the terminal back as it was, stops, and takes it again.
+void loop_suspend(void) {
+    loop_restore_terminal();
+    kill(getpid(), SIGSTOP);
+    loop_apply_raw_terminal();
+}
 
-  if (!buffer) {
-    fprintf(stderr, "pina_shell: allocation error\n");
-    exit(EXIT_FAILURE);
-  }
+void prompt_next_command(void) {
+    printf("pina_shell> ");
+    fflush(stdout);
 
-  // jnc begin
+    // 1. Asks for the next command.
+    speak_audio("Next command!");
+}
 
-  struct termios oldt, newt;
+///  @brief Speaks, keeps in the history and executes a line typed by the user.
+///  @return 1 if the shell should continue running, 0 if it should terminate
+int lsh_run_line(char *line) {
+    char **args;
+    int status;
+
+    if ( is_all_whitespace( line ) ) {
+        speak_audio("No command to execute.");
+        free(line);
+        return 1;
+    }
 
-  // Get the current terminal settings
-  tcgetattr(STDIN_FILENO, &oldt);
+    // 2. espeak-ng of the line containing the command.
+    speak_audio(line);
 
-  // Make a copy of the current settings to modify them
-  newt = oldt;
+    // 3. Adds the command to the list od past executed commands.
+    list_append_first(&list, line);
 
-  // Modify the terminal settings
-    newt.c_lflag &= ~(ICANON | ECHO); // Disable canonical mode and echo
+    printf("\nComand prev reverse list:\n");
+    list_print_reverse(&list);
 
-  // Set the new terminal settings
-  tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+    args = lsh_split_line(line);
+    launch_line_is_simple = expand_line_is_simple(line);
+    status = lsh_execute(args, 1);
 
-  // jnc end
+    free(line);
+    free(args);
+    return status;
+}
 
-  Node * node_current = list_first( &list );
+// Runs the lines typed ahead, until one launches a command.
+int loop_run_pending_lines(void) {
+    int status = 1;
+    while (status && !job_running() && pending_lines.size > 0) {
+        char *line = strdup(list_get_data(list_last(&pending_lines)));
+        list_delete(&pending_lines, list_last(&pending_lines));
+        status = lsh_run_line(line);
+    }
+    return status;
+}
 
-  int flag_before_up_arrow = 1;
+// ***************************************************************
 
-  while (1) {
-    // Read a character
-    c = getchar();
+// jnc end
 
-    if (c == EOF) {
-      
-      // jnc begino
-      // Restore the old terminal settings
-      tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
-      // jnc fim
 
-      exit(EXIT_SUCCESS);
-    } else if (c == '\n') {
-      buffer[position] = '\0';
-      position++;  // aqui
+/// @brief Loop getting input and executing it.
+void lsh_loop(void)
+{
+  int status = 1;
 
-      printf("\n");
+  // jnc begin
 
-      // jnc  begin
-      // Restore the old terminal settings
-      tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
-      // jnc fim
+  list_init(&pending_lines);
+  line_editor_reset(&editor);
+
+  // The keyboard is read key by key, without echo, for the whole session.
+  if (tcgetattr(STDIN_FILENO, &loop_saved_termios) == 0) {
+      loop_raw_termios = loop_saved_termios;
+      loop_raw_termios.c_lflag &= ~(ICANON | ECHO); // Disable canonical mode and echo
+      loop_has_termios = 1;
+      loop_apply_raw_terminal();
+      atexit(loop_restore_terminal);
+
+      signal(SIGSEGV, loop_fatal_signal_handler);
+      signal(SIGBUS,  loop_fatal_signal_handler);
+      signal(SIGFPE,  loop_fatal_signal_handler);
+      signal(SIGABRT, loop_fatal_signal_handler);
+  }
 
-      return buffer;
-    } else {
-      // buffer[position] = c;
-
-      // jnc begin
-
-      // Speak the character
-      switch (c)
-      {
-        case ' ':
-          buffer[position] = c;
-          position++;
-          printf("%c", c);
-          speak_audio("space");
-
-          // printf("\n position: %d\n", position);
-
-          if (position > 1 && buffer[position - 2] != ' ' && buffer[position - 2] != '\t') {
-              // Speak last word if last character wasn't a space.
-              
-              // printf("\n buffer[position - 2]: %d\n", buffer[position - 2]);
-
-              // Find the beginning of the last word.
-              int n = 2; 
-              int flag_found_begin_prev_word = 0;
-              while (flag_found_begin_prev_word == 0  && position - n >= 0) {
-                  char char_tmp = buffer[position - n];
-
-                  // printf("\n n inside cycle: %d\n", n);    
-                  // printf("\n char_tmp: [%c]\n", char_tmp);
-
-                  if (char_tmp == ' ' || char_tmp == '\t' || position - n == 0) {
-                      flag_found_begin_prev_word = 1;
-                      break;
-                  } else {
-                      n++;
-                  }
-              }
-                        
-              // Copy the last word to a null terminated buffer.
-              char last_word_buffer[300] = {0};
-              strncpy(last_word_buffer, &buffer[position - n], n - 1);
+  // The commands get the terminal, unless the user types ahead.
+  const char *typeahead = getenv("PINA_TYPEAHEAD");
+  job_own_group      = 1;
+  job_takes_terminal = loop_has_termios && (typeahead == NULL || atoi(typeahead) == 0);
+  job_stdin_null     = !job_takes_terminal;
+  // Taking the terminal back, from the background, must not stop the shell.
+  signal(SIGTTOU, SIG_IGN);
+  signal(SIGTTIN, SIG_IGN);
+
+  sigemptyset(&loop_signals);
+  sigaddset(&loop_signals, SIGINT);
+  sigaddset(&loop_signals, SIGCHLD);
+  sigaddset(&loop_signals, SIGTSTP);
+  sigaddset(&loop_signals, SIGTERM);
+  sigaddset(&loop_signals, SIGHUP);
+  sigprocmask(SIG_BLOCK, &loop_signals, NULL);
+  int signal_fd = signalfd(-1, &loop_signals, SFD_CLOEXEC);
+
+  loop_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (signal_fd == -1 || loop_epoll_fd == -1) {
+      perror("pina_shell: event loop");
+      exit(EXIT_FAILURE);
+  }
 
-              // printf("\n n: %d\n", n);
-              // printf("\n last_word_buffer: %s\n", last_word_buffer);
+  struct epoll_event ev;
+  ev.events  = EPOLLIN;
+  ev.data.fd = signal_fd;
+  epoll_ctl(loop_epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev);
 
-              speak_audio( last_word_buffer );
-          }
-          break;
-        case '\t':
-          buffer[position] = c;
-          position++;
-          printf("%c", c);
-          speak_audio("tab");
-          break;
-        // case '-':
-        //   buffer[position] = c;
-        //   position++;
-        //   printf("%c", c);
-        //   speak_audio("minus");
-        //   break;  
-        case '\b':
-        case 127:  // 127 The ASCII para backspace DEL in same terminal's shell.
-          speak_audio("backspace");
-        
-          if (position > 0) {
-
-            // speak_audio_char( c );
-
-            if (buffer[position - 1] == '\t') {  // backspace em tab.
-                speak_audio( "tab" );
-
-                // There should be a better way to do this.
-                // It has to make the backspace 5 times, then print 5 spaces to
-                // write over with spaces and erase the character.
-                // that are on the screen, then it does backspace again. 
-                printf("\b\b\b\b \b");
-            } else {
-                if (buffer[position - 1] == ' ') {  // backspace with space.
-                    speak_audio( "space" );
-                } else {
-                    speak_audio_char( buffer[position - 1] );
-                }
+  // A regular file can't be watched by epoll, it is always readable.
+  ev.data.fd = STDIN_FILENO;
+  int stdin_open = 1;
+  int stdin_always_ready = epoll_ctl(loop_epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == -1;
+  loop_stdin_watched = !stdin_always_ready;
 
-                // Has to do backspace, then print of one space to erase the
-                // character that is on the screen e then backspace again. 
-                printf("\b \b");
-            } 
-
-            buffer[position] = '\0';
-            position--;
-            // And also doesn't increment the position variable because the
-            // character has been erased and the current is a erasing character
-          } else {
-            speak_audio("Empty line");
+  speak_audio("Pina shells is ready.");
+  prompt_next_command();
+
+  // Runs until exit, or the end of the input once the commands ended.
+  while (status && (stdin_open || job_running())) {
+      struct epoll_event events[8];
+      int timeout = (stdin_open && stdin_always_ready) ? 0 : -1;
+      if (timeout == -1 && speech_speaking != NULL) {
+          // Polls the backends that don't end in a child, like lookahead.
+          timeout = 50;
+      }
+      int num_events = epoll_wait(loop_epoll_fd, events, 8, timeout);
+      if (num_events == 0 && speech_speaking != NULL) {
+          speech_pump();
+      }
+      if (num_events == -1) {
+          if (errno == EINTR) {
+              continue;
           }
+          perror("epoll_wait");
           break;
-        case 0x1B:  
-           // Escape character  0x1B '[' 'A'   // 'A' - UP Arrow and 'B' - DOWN Arrow
-          
-          // buffer[position] = c;
-          // position++;
-          // printf("%c", c);
-
-          // Read a character
-          c = getchar();
-          if ( c != '[' ) {
-              // It's not the up or down arrows characters.
-              printf("%c", c );
-              // printf("Character escape followed by Square bracket" );
-              break;
-          }
+      }
 
-          // Read a character
-          c = getchar();
-          if ( c != 'A' && c != 'B' ) {
-              // It's not the up or down arrows characters.
-              printf("%c", c );
-              break;
+      // The ready file descriptors, the signals first so that Ctrl-C isn't
+      // delayed by output, and stdin if epoll can't watch it.
+      int ready_fds[9];
+      for (int i = 0; i < num_events; i++) {
+          ready_fds[i] = events[i].data.fd;
+          if (ready_fds[i] == signal_fd) {
+              ready_fds[i] = ready_fds[0];
+              ready_fds[0] = signal_fd;
           }
-          printf(" ");
-
-          
-          int flag_end_list = 0;
+      }
+      if (stdin_open && stdin_always_ready) {
+          ready_fds[num_events++] = STDIN_FILENO;
+      }
 
-          if (c == 'A') {
-              // UP ARROW
+      for (int i = 0; i < num_events && status; i++) {
+          int fd = ready_fds[i];
 
-              speak_audio("up arrow");
+          if (fd == STDIN_FILENO && stdin_open) {
+              char keys[256];
+              ssize_t num_keys = read(STDIN_FILENO, keys, sizeof(keys));
+              if (num_keys < 0 && (errno == EINTR || errno == EAGAIN)) {
+                  continue;
+              }
+              if (num_keys <= 0) {
+                  // EOF, exits when the running command ends.
+                  if (loop_stdin_watched) {
+                      epoll_ctl(loop_epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+                  }
+                  loop_stdin_watched = 0;
+                  stdin_open = 0;
+                  continue;
+              }
 
-              if (flag_before_up_arrow ==  1) {
-                  // Shows the current line.
-                  // Pass
-                  flag_before_up_arrow = 0;
-                  
-              } else {
-                
-                // Advances to the next line, that means one line up.
-
-                if (node_current != NULL) {
-                  Node * node_tmp = list_next( node_current );
-
-                  if (node_tmp == NULL) {
-                      // espeak-ng end list.
-                      speak_audio("end list");
-                      flag_end_list = 1;
-                      // position--;   // aqui
-                      // This is because the espeak-ng seams to be putting one
-                      // more character in the buffer.
-                      printf("\b");
-                      break;
-                  } else {
-                    node_current = node_tmp;
+              speech_focus();
+              for (int k = 0; k < num_keys && status; k++) {
+                  if (!line_editor_feed(&editor, (unsigned char) keys[k])) {
+                      continue;
+                  }
+                  char *line = line_editor_take(&editor);
+                  if (job_running()) {
+                      // Type ahead, runs after the current command.
+                      list_append_first(&pending_lines, line);
+                      free(line);
+                      speak_audio("queued");
+                      continue;
+                  }
+                  status = lsh_run_line(line);
+                  if (status && !job_running()) {
+                      prompt_next_command();
                   }
-                }
               }
-          } else if (c == 'B') {
-              // DOWN ARROW
-
-              speak_audio("down arrow");
-              
-              // int flag_end_list = 0;
-
-              if (flag_before_up_arrow ==  1) {
-                  // Shows the current line.
-                  
-                  // Pass
-                  
-                  // flag_before_down_arrow = 0;
-                  break;
-                  
+          } else if (fd == signal_fd) {
+              struct signalfd_siginfo si;
+              if (read(signal_fd, &si, sizeof(si)) != sizeof(si)) {
+                  continue;
+              }
+              if (si.ssi_signo == SIGINT) {
+                  loop_interrupt();
+              } else if (si.ssi_signo == SIGCHLD) {
+                  job_reap(WNOHANG);
+                  speech_pump();
+              } else if (si.ssi_signo == SIGTSTP) {
+                  loop_suspend();
               } else {
-                // Comes back to the previous line, that means one line down.
-
-                if (node_current != NULL) {
-                  Node * node_tmp = list_prev( node_current );
-
-                  if (node_tmp == NULL) {
-                      // espeak-ng end list.
-                      speak_audio("begin list");
-                      flag_end_list = 1;
-                      // This is because the espeak-ng seams to be putting one
-                      // more character in the buffer.
-                      printf("\b");   
-                      
-                      break;
-                  } else {
-                    node_current = node_tmp;
+                  // SIGTERM or SIGHUP, the command goes with the shell.
+                  if (job_running()) {
+                      job_signal(si.ssi_signo);
                   }
-                }
+                  speech_cancel();
+                  status = 0;
               }
-          } 
-
-
-          if (flag_end_list == 0) {
-              if (node_current != NULL) {
-                  // Erases the previous line.
-                                  
-                  // printf("\r                                                                            \r");
-
-                  // Moves the cursor to the beginning of the line
-                  // and writes over the line with spaces.
-                  if (position >= 0) {
-                      printf("\r%*s", (int)(strlen(buffer) + 60), "");
-                  } 
-
-                  // printf("\r%*s", (int)strlen(buffer - 1), "");
-
-                  char * my_str = (char *) node_current->data;
-                  // Put's the curor at the beginning of the line.
-                  printf( "\rpina_shell> %s", my_str );
-                  fflush( stdout );
+          } else if (job_running() && fd == job.fd__std_out) {
+              job_read_pipe(&job.fd__std_out);
+          } else if (job_running() && fd == job.fd__std_err) {
+              job_read_pipe(&job.fd__std_err);
+          }
+      }
 
-                  // Copies thea node_current->data to the buffer.
-                  int i = 0;
-                  while (my_str[i] != '\0') {
-                      buffer[i] = my_str[i];
-                      i++;
-                  }
-                  buffer[i] = '\0';
-                  // position = i + 1;
-                  position = i;
-                 
-                  speak_audio( my_str );
-                  // node_current = node_current->next;
-              }
-              // } else {
-              //    speak_audio("Empty line");  
-              // }
+      if (job_done()) {
+          loop_take_terminal();
+          job_finish();
+          status = loop_run_pending_lines();
+          if (status && !job_running()) {
+              prompt_next_command();
           }
-                    
-          break;
-        
-        default:
-label:    buffer[position] = c;
-          position++;
-          printf("%c", c);
-          
-          // printf("\n up arrow [%d]:(%d) \n", c, c);
-          
-          char char_str_2[2];
-          char_str_2[0] = c;
-          char_str_2[1] = '\0';
-          speak_audio( char_str_2 );
-          break;
       }
+  }
 
-      // if (c == " " || c == "\t" || c == "\r" || c == "\n") {
-      
-      // jnc end
+  close(loop_epoll_fd);
+  loop_epoll_fd = -1;
+  close(signal_fd);
 
-    }
-    // position++;
+  list_free(&list);
+  list_free(&pending_lines);
+  review_free(&review);
+  // jnc end  
 
-    // If we have exceeded the buffer, reallocate.
-    if (position >= bufsize) {
-      bufsize += LSH_RL_BUFSIZE;
-      buffer = realloc(buffer, bufsize);
-      if (!buffer) {
-        fprintf(stderr, "pina_shell: allocation error\n");
+}
 
-        // jnc end
 
-        // Restore the old terminal settings
-        tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
+// jnc begin
 
-        // jnc fim
+// ***************************************************************
+// Non interactive modes ( implementation ).
+//
+// pina_shell -c "command", pina_shell script and commands read from a pipe
+// don't touch the terminal settings and don't speak the prompts nor the
+// commands, only the batched narration of the outputs.
 
-        exit(EXIT_FAILURE);
-      }
+///  @brief Executes one line of a script.
+///  @return 1 if the shell should continue running, 0 if it should terminate
+int lsh_run_script_line(char *line) {
+    char *start = line;
+    while (isspace((unsigned char) *start)) {
+        start++;
+    }
+    if (*start == '\0' || *start == '#') {
+        // Blank line or comment.
+        return 1;
     }
-  }
 
-/*
-#endif
-*/
+    char **args = lsh_split_line(line);
+    launch_line_is_simple = expand_line_is_simple(line);
+    int status = lsh_execute(args, 1);
+    free(args);
+    return status;
+}
+
+///  @brief Executes the lines of a script until its end or exit.
+///  @return The exit status of the last command.
+int lsh_run_script(FILE *input) {
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t len;
 
+    while ((len = getline(&line, &line_capacity, input)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') {
+            line[len - 1] = '\0';
+        }
+        if (!lsh_run_script_line(line)) {
+            break;
+        }
+    }
+    free(line);
+    return last_exit_status;
 }
 
-#define LSH_TOK_BUFSIZE 64
-#define LSH_TOK_DELIM " \t\r\n\a"
+void lsh_usage(void) {
+    printf("usage: pina_shell [--tts backend] [-c command | script | --speech-daemon]\n");
+    printf("  -c command       runs the command and exits with its status\n");
+    printf("  script           runs the lines of the script file\n");
+    printf("  --tts backend    espeak-ng, lookahead, libespeak-ng ( built with\n");
+    printf("                   LIBESPEAK=1 ), wav, null, socket or daemon\n");
+    printf("                   ( see PINA_TTS )\n");
+    printf("  --speech-daemon  speaks for all the shells started with\n");
+    printf("                   PINA_TTS=daemon, with the --tts backend\n");
+    printf("Without a command or script, the lines are read from stdin when\n");
+    printf("it isn't a terminal.\n");
+}
 
-///  @brief Split a line into tokens (very naively).
-///  @param line The line.
-///  @return Null-terminated array of tokens.
- 
+// ***************************************************************
 
-/*
-char **lsh_split_line(char *line)
-{
-  int bufsize = LSH_TOK_BUFSIZE, position = 0;
-  char **tokens = malloc(bufsize * sizeof(char*));
-  char *token, **tokens_backup;
+// ***************************************************************
+// Speech daemon ( implementation ).
+//
+// pina_shell --speech-daemon owns the synthesizer for all the shells of the
+// user, that connect with PINA_TTS=daemon to its Unix socket and send their
+// utterances in the SSIP subset of the socket backend. The shell where a
+// key was last pressed has the focus:
+//   - its utterances are spoken the most important first, and preempt the
+//     ones of the other shells and its own less important ones;
+//   - the messages and errors of the shells in the background wait until
+//     the focused one is silent, and are spoken after the name of their
+//     shell ( "pane 3" in tmux );
+//   - their narration isn't spoken, only counted, and the count is told
+//     with their next message or when they take the focus.
+// An utterance that is preempted goes back to the head of its queue. The
+// shells that ask for the END and CANCEL notifications are told when each
+// of their messages was spoken or dropped.
+// The first shell started with PINA_TTS=daemon starts the daemon, that
+// exits PINA_DAEMON_IDLE_SEC after the last shell left. Its synthesizer is
+// the backend in PINA_DAEMON_TTS ( or --tts ), espeak-ng by default.
+
+#define PINA_DAEMON_MAX_CLIENTS 32
+#define PINA_DAEMON_MAX_LINE    (64 * 1024)
+#define PINA_DAEMON_IDLE_SEC    60.0
+
+typedef struct DaemonClient {
+    int         fd;             // -1 for a free slot.
+    char        name[32];       // For the messages spoken in the background.
+    int         priority;       // Of the next SPEAK, PINA_SPEECH_*.
+    int         rate;           // Words per minute, 0 for the default.
+    int         receiving;      // Between SPEAK and the line with the '.'.
+    DynBuffer   input;          // Received, not yet a whole line.
+    DynBuffer   text;           // The text of the SPEAK being received.
+    double      focus_time;     // When it last took the focus, 0 never.
+    int         skipped;        // Narration not spoken in the background.
+    int         notify_end;     // Notifications asked for.
+    int         notify_cancel;
+    SpeechQueue queues[PINA_SPEECH_PRIORITIES];
+} DaemonClient;
+
+DaemonClient  daemon_clients[PINA_DAEMON_MAX_CLIENTS];
+int           daemon_num_clients = 0;
+
+// Who said what is being spoken, NULL when the synthesizer is idle.
+DaemonClient *daemon_speaking_client   = NULL;
+Utterance    *daemon_speaking          = NULL;
+int           daemon_speaking_priority = -1;
+int           daemon_rate              = 0;
+long          daemon_next_id           = 0;
+
+// The client that has the focus, NULL if no client asked for it.
+DaemonClient *daemon_focused(void) {
+    DaemonClient *focused = NULL;
+    for (int i = 0; i < PINA_DAEMON_MAX_CLIENTS; i++) {
+        DaemonClient *c = &daemon_clients[i];
+        if (c->fd >= 0 && c->focus_time > 0
+            && (focused == NULL || c->focus_time > focused->focus_time)) {
+            focused = c;
+        }
+    }
+    return focused;
+}
 
-  if (!tokens) {
-    fprintf(stderr, "lsh: allocation error\n");
-    exit(EXIT_FAILURE);
-  }
+int daemon_in_background(DaemonClient *c) {
+    DaemonClient *focused = daemon_focused();
+    return focused != NULL && focused != c;
+}
 
-  token = strtok(line, LSH_TOK_DELIM);
-  while (token != NULL) {
-    tokens[position] = token;
-    position++;
+void daemon_reply(DaemonClient *c, const char *reply) {
+    size_t len = strlen(reply);
+    while (len > 0) {
+        ssize_t n = send(c->fd, reply, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        reply += n;
+        len   -= n;
+    }
+}
 
-    if (position >= bufsize) {
-      bufsize += LSH_TOK_BUFSIZE;
-      tokens_backup = tokens;
-      tokens = realloc(tokens, bufsize * sizeof(char*));
-      if (!tokens) {
-		      free(tokens_backup);
-          fprintf(stderr, "lsh: allocation error\n");
-          exit(EXIT_FAILURE);
-      }
+// Tells the client that its message was spoken ( 702 END ) or dropped
+// ( 703 CANCELED ), if it asked for it. The messages of the daemon have
+// the id 0.
+void daemon_notify(DaemonClient *c, long id, int code) {
+    if (id == 0 || (code == 702 && !c->notify_end) || (code == 703 && !c->notify_cancel)) {
+        return;
     }
+    char event[128];
+    snprintf(event, sizeof(event), "%d-%ld\r\n%d-%d\r\n%d %s\r\n", code, id, code,
+             (int) (c - daemon_clients) + 1, code, code == 702 ? "END" : "CANCELED");
+    daemon_reply(c, event);
+}
 
-    token = strtok(NULL, LSH_TOK_DELIM);
-  }
-  tokens[position] = NULL;
-  return tokens;
+void daemon_enqueue(DaemonClient *c, char *text, int priority, long id) {
+    Utterance *u = malloc(sizeof(Utterance));
+    if (!u) {
+        fprintf(stderr, "pina_shell: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    u->text = text;
+    u->id   = id;
+    u->next = NULL;
+    SpeechQueue *q = &c->queues[priority];
+    if (q->tail != NULL) {
+        q->tail->next = u;
+    } else {
+        q->head = u;
+    }
+    q->tail = u;
 }
 
-*/
+// Drops the queued utterances of the client of the priority, or of all
+// if -1, and returns how many.
+int daemon_drop_queued(DaemonClient *c, int priority) {
+    int dropped = 0;
+    for (int p = 0; p < PINA_SPEECH_PRIORITIES; p++) {
+        if (priority >= 0 && p != priority) {
+            continue;
+        }
+        Utterance *u = c->queues[p].head;
+        while (u != NULL) {
+            Utterance *next = u->next;
+            daemon_notify(c, u->id, 703);
+            free(u->text);
+            free(u);
+            dropped++;
+            u = next;
+        }
+        c->queues[p].head = NULL;
+        c->queues[p].tail = NULL;
+    }
+    return dropped;
+}
 
+// The utterance being spoken is done: spoken ( 702 ) or dropped ( 703 ).
+void daemon_speaking_done(int code) {
+    if (daemon_speaking != NULL) {
+        daemon_notify(daemon_speaking_client, daemon_speaking->id, code);
+        free(daemon_speaking->text);
+        free(daemon_speaking);
+    }
+    daemon_speaking          = NULL;
+    daemon_speaking_client   = NULL;
+    daemon_speaking_priority = -1;
+}
 
+void daemon_silence(void) {
+    speech->cancel();
+    daemon_speaking_done(703);
+}
 
-// jnc begin
+// Silences the utterance being spoken and puts it back at the head of its
+// queue, to be spoken again after the more important one.
+void daemon_preempt(void) {
+    speech->cancel();
+    Utterance *u = daemon_speaking;
+    if (u != NULL) {
+        SpeechQueue *q = &daemon_speaking_client->queues[daemon_speaking_priority];
+        u->next = q->head;
+        q->head = u;
+        if (q->tail == NULL) {
+            q->tail = u;
+        }
+    }
+    daemon_speaking          = NULL;
+    daemon_speaking_client   = NULL;
+    daemon_speaking_priority = -1;
+}
 
-char **lsh_split_line(char *line) {
-    int bufsize = LSH_TOK_BUFSIZE, position = 0;
-    char **tokens = malloc(bufsize * sizeof(char*));
-    if (!tokens) {
-        fprintf(stderr, "lsh: allocation error\n");
-        exit(EXIT_FAILURE);
+// The most important utterance of the client, from the priority on.
+Utterance *daemon_dequeue(DaemonClient *c, int max_priority, int *priority) {
+    for (int p = 0; p <= max_priority; p++) {
+        Utterance *u = c->queues[p].head;
+        if (u != NULL) {
+            c->queues[p].head = u->next;
+            if (c->queues[p].head == NULL) {
+                c->queues[p].tail = NULL;
+            }
+            *priority = p;
+            return u;
+        }
     }
+    return NULL;
+}
 
-    char *start = line, *end = line;
-    while (*end) {
-        // Skip whitespace
-        while (*end && strchr(LSH_TOK_DELIM, *end)) {
-            end++;
+// Picks the next utterance: the focused client first, without a focus the
+// most important of all, otherwise the messages of the background.
+Utterance *daemon_pick(DaemonClient **from, int *priority) {
+    DaemonClient *focused = daemon_focused();
+    if (focused != NULL) {
+        Utterance *u = daemon_dequeue(focused, PINA_SPEECH_NARRATION, priority);
+        if (u != NULL) {
+            *from = focused;
+            return u;
         }
-        start = end;
+    }
 
-        // Handle quoted strings
-        if (*end == '"') {
-            start++;  // move past the starting quote
-            end++;
-            while (*end && *end != '"') {
-                end++;
-            }
-            if (*end) {
-                tokens[position] = strndup(start, end - start);
-                end++;  // skip the ending quote
-            } else {
-                tokens[position] = strdup(start);  // unmatched quote, copy the rest
-            }
-        } else {
-            // Find the next delimiter
-            while (*end && !strchr(LSH_TOK_DELIM, *end) && *end != '"') {
-                end++;
+    for (int p = 0; p < PINA_SPEECH_PRIORITIES; p++) {
+        for (int i = 0; i < PINA_DAEMON_MAX_CLIENTS; i++) {
+            DaemonClient *c = &daemon_clients[i];
+            if (c->fd >= 0 && c->queues[p].head != NULL) {
+                *from = c;
+                return daemon_dequeue(c, p, priority);
             }
-            tokens[position] = strndup(start, end - start);
         }
+    }
+    return NULL;
+}
 
-        if (!tokens[position]) {
-            fprintf(stderr, "lsh: allocation error\n");
-            exit(EXIT_FAILURE);
+///  @brief Hands the next utterance to the synthesizer when it is done with
+///         the one it had.
+void daemon_pump(void) {
+    while (!speech->busy()) {
+        daemon_speaking_done(702);
+        DaemonClient *c;
+        int priority;
+        Utterance *u = daemon_pick(&c, &priority);
+        if (u == NULL) {
+            break;
         }
-        position++;
 
-        if (position >= bufsize) {
-            bufsize += LSH_TOK_BUFSIZE;
-            tokens = realloc(tokens, bufsize * sizeof(char*));
-            if (!tokens) {
-                fprintf(stderr, "lsh: allocation error\n");
+        if (c->rate != daemon_rate) {
+            speech->set_rate(c->rate);
+            daemon_rate = c->rate;
+        }
+
+        if (daemon_in_background(c)) {
+            char summary[64] = "";
+            if (c->skipped > 0) {
+                snprintf(summary, sizeof(summary), "%d %s not spoken, ", c->skipped,
+                         c->skipped == 1 ? "message" : "messages");
+                c->skipped = 0;
+            }
+            size_t len = strlen(c->name) + strlen(summary) + strlen(u->text) + 3;
+            char *text = malloc(len);
+            if (!text) {
+                fprintf(stderr, "pina_shell: allocation error\n");
                 exit(EXIT_FAILURE);
             }
+            snprintf(text, len, "%s, %s%s", c->name, summary, u->text);
+            speech->speak(text);
+            free(text);
+        } else {
+            speech->speak(u->text);
         }
+        daemon_speaking          = u;
+        daemon_speaking_client   = c;
+        daemon_speaking_priority = priority;
     }
-    tokens[position] = NULL;
-    return tokens;
 }
 
+// The client takes the focus: the narration of the others, queued or being
+// spoken, is only counted from now on, and the echo of their keys is late.
+void daemon_focus(DaemonClient *c) {
+    DaemonClient *previous = daemon_focused();
+    c->focus_time = monotonic_seconds();
+    if (previous == c) {
+        return;
+    }
 
-// jnc end
+    for (int i = 0; i < PINA_DAEMON_MAX_CLIENTS; i++) {
+        DaemonClient *other = &daemon_clients[i];
+        if (other->fd >= 0 && other != c) {
+            other->skipped += daemon_drop_queued(other, PINA_SPEECH_NARRATION);
+            daemon_drop_queued(other, PINA_SPEECH_ECHO);
+        }
+    }
+    if (daemon_speaking_client != NULL && daemon_speaking_client != c
+        && daemon_speaking_priority == PINA_SPEECH_NARRATION && speech->busy()) {
+        daemon_silence();
+    }
 
+    if (c->skipped > 0) {
+        char text[64];
+        snprintf(text, sizeof(text), "%d %s not spoken in the background", c->skipped,
+                 c->skipped == 1 ? "message" : "messages");
+        daemon_enqueue(c, strdup(text), PINA_SPEECH_PROMPT, 0);
+        c->skipped = 0;
+    }
+}
 
+// A SPEAK was received in full, and its id sent to the client.
+void daemon_speak(DaemonClient *c, char *text, long id) {
+    int priority = c->priority;
+    // In the background the narration is only counted, and an echo is
+    // stale ( its keys would have given the focus ). The errors and alerts
+    // wait with the messages.
+    if (daemon_in_background(c) && (priority == PINA_SPEECH_NARRATION || priority == PINA_SPEECH_ECHO)) {
+        c->skipped += priority == PINA_SPEECH_NARRATION;
+        daemon_notify(c, id, 703);
+        free(text);
+        return;
+    }
+    daemon_enqueue(c, text, priority, id);
 
-/// @brief Loop getting input and executing it.
-void lsh_loop(void)
-{
-  char *line;
-  char **args;
-  int status;
+    // Interrupts what is being spoken if it is less important, or if it is
+    // the background talking over the foreground.
+    if (daemon_speaking_client != NULL && speech->busy() && !daemon_in_background(c)
+        && (daemon_speaking_priority > priority || daemon_in_background(daemon_speaking_client))) {
+        daemon_preempt();
+    }
+}
 
+void daemon_close_client(DaemonClient *c) {
+    if (daemon_speaking_client == c) {
+        daemon_silence();
+    }
+    daemon_drop_queued(c, -1);
+    dyn_buffer_free(&c->input);
+    dyn_buffer_free(&c->text);
+    close(c->fd);
+    c->fd = -1;
+    daemon_num_clients--;
+}
 
-  // jnc begin
+// Maps the SSIP priorities to the ones of the shell, the inverse of
+// tts_ssip_priorities.
+int daemon_parse_priority(const char *name) {
+    for (int p = 0; p < PINA_SPEECH_PRIORITIES; p++) {
+        if (strcasecmp(name, tts_ssip_priorities[p]) == 0) {
+            return p;
+        }
+    }
+    if (strcasecmp(name, "progress") == 0) {
+        return PINA_SPEECH_NARRATION;
+    }
+    return -1;
+}
 
-  // LinkedList list;
-  list_init(&list);
+// SET self NAME VALUE
+void daemon_set(DaemonClient *c, char *name, char *value) {
+    if (name == NULL || value == NULL) {
+        daemon_reply(c, "302 ERR MISSING PARAMETER\r\n");
+    } else if (strcasecmp(name, "CLIENT_NAME") == 0) {
+        // user:application:component, pina_shell sends paneN in tmux.
+        const char *component = strrchr(value, ':');
+        component = component != NULL ? component + 1 : value;
+        if (strncmp(component, "pane", 4) == 0 && isdigit((unsigned char) component[4])) {
+            snprintf(c->name, sizeof(c->name), "pane %.16s", component + 4);
+        }
+        daemon_reply(c, "208 OK CLIENT NAME SET\r\n");
+    } else if (strcasecmp(name, "PRIORITY") == 0) {
+        int priority = daemon_parse_priority(value);
+        if (priority < 0) {
+            daemon_reply(c, "409 ERR INVALID PRIORITY\r\n");
+        } else {
+            c->priority = priority;
+            daemon_reply(c, "202 OK PRIORITY SET\r\n");
+        }
+    } else if (strcasecmp(name, "RATE") == 0) {
+        // The inverse of tts_socket_set_rate().
+        int rate = atoi(value);
+        c->rate = rate == 0 ? 0 : 175 + rate * 275 / 100;
+        daemon_reply(c, "203 OK RATE SET\r\n");
+    } else if (strcasecmp(name, "PUNCTUATION") == 0) {
+        daemon_reply(c, "205 OK PUNCTUATION SET\r\n");
+    } else if (strcasecmp(name, "FOCUS") == 0) {
+        daemon_focus(c);
+        daemon_reply(c, "299 OK FOCUS SET\r\n");
+    } else if (strcasecmp(name, "NOTIFICATION") == 0) {
+        // NOTIFICATION end|cancel|all on|off, the others are never sent.
+        char *save = NULL;
+        char *type  = strtok_r(value, " ", &save);
+        char *state = strtok_r(NULL, " ", &save);
+        int on  = state != NULL && strcasecmp(state, "on") == 0;
+        int all = strcasecmp(type, "all") == 0;
+        if (state == NULL || (!on && strcasecmp(state, "off") != 0)) {
+            daemon_reply(c, "302 ERR MISSING PARAMETER\r\n");
+            return;
+        }
+        if (all || strcasecmp(type, "end") == 0) {
+            c->notify_end = on;
+        }
+        if (all || strcasecmp(type, "cancel") == 0) {
+            c->notify_cancel = on;
+        }
+        daemon_reply(c, "261 OK NOTIFICATION SET\r\n");
+    } else {
+        daemon_reply(c, "410 ERR UNKNOWN PARAMETER\r\n");
+    }
+}
 
-  
-  /*
-    printf("First element: %s\n", list_get_at(&list, 0));
-    printf("Second element: %s\n", list_get_at(&list, 1));
-  */
+///  @brief Handles one line from the client, without its CRLF.
+///  @return 0 if the client quit.
+int daemon_handle_line(DaemonClient *c, char *line) {
+    if (c->receiving) {
+        if (strcmp(line, ".") == 0) {
+            c->receiving = 0;
+            long id = ++daemon_next_id;
+            char reply[64];
+            snprintf(reply, sizeof(reply), "225-%ld\r\n225 OK MESSAGE QUEUED\r\n", id);
+            daemon_reply(c, reply);
+            if (c->text.len > 0) {
+                c->text.data[--c->text.len] = '\0';   // The last newline.
+                daemon_speak(c, c->text.data, id);
+                dyn_buffer_init(&c->text);
+            } else {
+                daemon_notify(c, id, 702);
+            }
+        } else {
+            // A line starting with '.' was sent with one more.
+            const char *data = line[0] == '.' ? line + 1 : line;
+            dyn_buffer_append(&c->text, data, strlen(data));
+            dyn_buffer_append(&c->text, "\n", 1);
+        }
+        return 1;
+    }
 
-  speak_audio("Pina shells is ready.");
-  
-  // jnc end
+    char *save = NULL;
+    char *command = strtok_r(line, " ", &save);
+    if (command == NULL) {
+        daemon_reply(c, "300 ERR UNKNOWN COMMAND\r\n");
+    } else if (strcasecmp(command, "SPEAK") == 0) {
+        c->receiving = 1;
+        c->text.len  = 0;
+        daemon_reply(c, "230 OK RECEIVING DATA\r\n");
+    } else if (strcasecmp(command, "SET") == 0) {
+        strtok_r(NULL, " ", &save);   // self
+        char *name  = strtok_r(NULL, " ", &save);
+        char *value = strtok_r(NULL, "", &save);    // The rest of the line.
+        daemon_set(c, name, value);
+    } else if (strcasecmp(command, "CANCEL") == 0 || strcasecmp(command, "STOP") == 0) {
+        daemon_drop_queued(c, -1);
+        if (daemon_speaking_client == c) {
+            daemon_silence();
+        }
+        daemon_reply(c, "210 OK CANCELED\r\n");
+    } else if (strcasecmp(command, "QUIT") == 0) {
+        daemon_reply(c, "231 HAPPY HACKING\r\n");
+        return 0;
+    } else {
+        daemon_reply(c, "300 ERR UNKNOWN COMMAND\r\n");
+    }
+    return 1;
+}
 
-  do {
-      printf("pina_shell> ");
+///  @brief Reads what the client sent and handles its complete lines.
+///  @return 0 if the client is gone.
+int daemon_read_client(DaemonClient *c) {
+    char buffer[4096];
+    ssize_t n = read(c->fd, buffer, sizeof(buffer));
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return 1;
+    }
+    if (n <= 0) {
+        return 0;
+    }
+    dyn_buffer_append(&c->input, buffer, n);
 
-// jnc begin
-  
-      // 1. Asks for the next command.
-      speak_audio("Next command!");
+    size_t start = 0;
+    for (size_t i = 0; i < c->input.len; i++) {
+        if (c->input.data[i] != '\n') {
+            continue;
+        }
+        size_t end = i;
+        if (end > start && c->input.data[end - 1] == '\r') {
+            end--;
+        }
+        c->input.data[end] = '\0';
+        if (!daemon_handle_line(c, c->input.data + start)) {
+            return 0;
+        }
+        start = i + 1;
+    }
+    memmove(c->input.data, c->input.data + start, c->input.len - start);
+    c->input.len -= start;
+    return c->input.len < PINA_DAEMON_MAX_LINE;
+}
 
-// jnc end
+void daemon_accept(int listen_fd, int epoll_fd) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    for (int i = 0; i < PINA_DAEMON_MAX_CLIENTS; i++) {
+        DaemonClient *c = &daemon_clients[i];
+        if (c->fd < 0) {
+            memset(c, 0, sizeof(*c));
+            c->fd       = fd;
+            c->priority = PINA_SPEECH_NARRATION;
+            snprintf(c->name, sizeof(c->name), "shell %d", i + 1);
+            dyn_buffer_init(&c->input);
+            dyn_buffer_init(&c->text);
+            daemon_num_clients++;
+
+            struct epoll_event ev;
+            ev.events   = EPOLLIN;
+            ev.data.ptr = c;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+            return;
+        }
+    }
+    close(fd);
+}
 
-      line = lsh_read_line();
-    
+///  @brief Runs the speech daemon until SIGTERM, or until it has been
+///         without clients for PINA_DAEMON_IDLE_SEC.
+///  @param tts_name The synthesizer backend, NULL for the default.
+///  @return The exit status.
+int speech_daemon_run(const char *tts_name) {
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    char lock_path[sizeof(path) + 8];
+    if (tts_daemon_socket_path(path, sizeof(path), 1) != 0) {
+        return EXIT_FAILURE;
+    }
 
-// jnc begin 
-
-      if ( //   line == NULL 
-           // || line[0] == '\0'
-           // || line[0] == ' '
-           // || line[0] == '\t'
-           is_all_whitespace( line ) 
-           ) {
-          speak_audio("No command to execute."); 
-          status = 1;
-          continue;
-      }
+    // One daemon per socket: the lock is held while it runs, so that two
+    // shells starting together don't both replace the socket.
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", path);
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX | LOCK_NB) == -1) {
+        fprintf(stderr, "pina_shell: a speech daemon is already running on %s\n", path);
+        return EXIT_FAILURE;
+    }
 
-      // 2. espeak-ng of the line containing the command.
-      speak_audio(line);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+        || listen(listen_fd, 16) == -1) {
+        perror("pina_shell: speech daemon");
+        return EXIT_FAILURE;
+    }
 
-      // 3. Adds the command to the list od past executed commands.
-      list_append_first(&list, line);
+    // The shells say "daemon", the synthesizer is the one of the daemon.
+    if (tts_name != NULL && (strcmp(tts_name, "daemon") == 0 || strcmp(tts_name, "socket") == 0)) {
+        tts_name = NULL;
+    }
+    speech_open(tts_name);
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGCHLD);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    int epoll_fd  = epoll_create1(EPOLL_CLOEXEC);
+    if (signal_fd == -1 || epoll_fd == -1) {
+        perror("pina_shell: speech daemon");
+        return EXIT_FAILURE;
+    }
 
-      printf("\nComand prev reverse list:\n");
-      list_print_reverse(&list);
+    for (int i = 0; i < PINA_DAEMON_MAX_CLIENTS; i++) {
+        daemon_clients[i].fd = -1;
+    }
+    struct epoll_event ev;
+    ev.events   = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    ev.data.ptr = &signal_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev);
+
+    const char *idle_env = getenv("PINA_DAEMON_IDLE_SEC");
+    double idle_sec = idle_env != NULL ? atof(idle_env) : PINA_DAEMON_IDLE_SEC;
+    double idle_since = monotonic_seconds();
+    int running = 1;
+
+    while (running) {
+        // Polls the synthesizers that don't end in a child, like lookahead.
+        int timeout = -1;
+        if (daemon_speaking_client != NULL) {
+            timeout = 50;
+        } else if (daemon_num_clients == 0 && idle_sec > 0) {
+            double left = idle_since + idle_sec - monotonic_seconds();
+            if (left <= 0) {
+                break;
+            }
+            timeout = (int) (left * 1000) + 1;
+        }
 
-      /*  
-      // NOTA: Pina didn't liked the idea of asking for confirmation after
-      //       entering each command.
+        struct epoll_event events[16];
+        int num_events = epoll_wait(epoll_fd, events, 16, timeout);
+        if (num_events == -1 && errno != EINTR) {
+            perror("pina_shell: speech daemon");
+            break;
+        }
 
-      // 3. espeak-ng.
-      speak_audio("Execute command? yes or no.");
+        for (int i = 0; i < num_events; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == NULL) {
+                daemon_accept(listen_fd, epoll_fd);
+            } else if (ptr == &signal_fd) {
+                struct signalfd_siginfo si;
+                if (read(signal_fd, &si, sizeof(si)) == sizeof(si) && si.ssi_signo != SIGCHLD) {
+                    running = 0;
+                }
+            } else {
+                DaemonClient *c = ptr;
+                if (c->fd >= 0 && !daemon_read_client(c)) {
+                    daemon_close_client(c);
+                    if (daemon_num_clients == 0) {
+                        idle_since = monotonic_seconds();
+                    }
+                }
+            }
+        }
+        daemon_pump();
+    }
 
-      printf("y/n ? : ");
+    for (int i = 0; i < PINA_DAEMON_MAX_CLIENTS; i++) {
+        if (daemon_clients[i].fd >= 0) {
+            daemon_close_client(&daemon_clients[i]);
+        }
+    }
+    daemon_silence();
+    speech->close();
+    unlink(path);
+    close(listen_fd);
+    close(epoll_fd);
+    close(signal_fd);
+    close(lock_fd);
+    return EXIT_SUCCESS;
+}
 
-      // 4. Reads the line with the response of the user y or n or nothing.
-      char *line_2;
-      line_2 = lsh_read_line();
-      if (line_2 != NULL && line_2[0] !='y') {
-          free(line_2);
- 
-          // Goes to the next iteration
-          continue;
-      }
-      free(line_2);
-      */
+// ***************************************************************
 
 // jnc end
-    
-
-    args = lsh_split_line(line);
-    status = lsh_execute(args, 1);
-
-    free(line);
-    free(args);
-
-  } while (status);
-
-  // jnc begin
-  list_free(&list);
-  // jnc end  
 
-}
 
+// jnc begin
+// Built with -DPINA_NO_MAIN, main.c is linked by microbench.c.
+#ifndef PINA_NO_MAIN
+// jnc end
 
 ///  @brief Main entry point.
 ///  @param argc Argument count.
@@ -1115,6 +6855,79 @@ int main(int argc, char **argv)
 {
   // Load config files, if any.
 
+  // jnc begin
+  const char *tts_name = getenv("PINA_TTS");
+  const char *speech_daemon_tts = getenv("PINA_DAEMON_TTS");
+  const char *command  = NULL;
+  const char *script   = NULL;
+  int speech_daemon    = 0;
+
+  for (int i = 1; i < argc && script == NULL; i++) {
+    if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      command = argv[++i];
+    } else if (strcmp(argv[i], "--tts") == 0 && i + 1 < argc) {
+      tts_name = argv[++i];
+      speech_daemon_tts = tts_name;
+    } else if (strcmp(argv[i], "--speech-daemon") == 0) {
+      speech_daemon = 1;
+    } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+      lsh_usage();
+      return EXIT_SUCCESS;
+    } else if (argv[i][0] == '-') {
+      lsh_usage();
+      return EXIT_FAILURE;
+    } else {
+      script = argv[i];
+    }
+  }
+
+  if (speech_daemon) {
+    return speech_daemon_run(speech_daemon_tts);
+  }
+
+  speech_open(tts_name);
+  atexit(speech_close);
+  stats_config_from_env();
+  alert_config_from_env();
+  skim_config_from_env();
+  echo_config_from_env();
+  // The widths of the UTF-8 characters on the screen.
+  setlocale(LC_CTYPE, "");
+
+  // LinkedList list;
+  list_init(&list);
+  review_init(&review);
+  // Records by default only the interactive sessions.
+  session_open(command == NULL && script == NULL && isatty(STDIN_FILENO));
+
+  if (command != NULL) {
+    interactive = 0;
+    char *line = strdup(command);
+    lsh_run_script_line(line);
+    free(line);
+    return last_exit_status;
+  }
+
+  if (script != NULL) {
+    FILE *input = fopen(script, "r");
+    if (input == NULL) {
+      perror("pina_shell");
+      return 127;
+    }
+    interactive = 0;
+    int status = lsh_run_script(input);
+    fclose(input);
+    return status;
+  }
+
+  if (!isatty(STDIN_FILENO)) {
+    // The commands come from a pipe or a file.
+    interactive    = 0;
+    job_stdin_null = 1;
+    return lsh_run_script(stdin);
+  }
+  // jnc end
+
   // Run command loop.
   lsh_loop();
 
@@ -1123,3 +6936,6 @@ int main(int argc, char **argv)
   return EXIT_SUCCESS;
 }
 
+// jnc begin
+#endif
+// jnc end
@@ -0,0 +1,293 @@
+//*****************************************************************************
+//
+//  name:   pina_shell microbenchmarks
+//
+//  description: Measures the kernels of pina_shell that are on the hot path,
+//               over realistic inputs: short commands, 1 MB outputs and a
+//               10k entries history. Reports ns/op and, for the kernels that
+//               go over bytes, MB/s.
+//
+//  to run: $ make microbench
+//
+//  file:   microbench.c
+//
+//  License: MIT Open Source License
+//
+//*****************************************************************************
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pina_shell.h"
+
+// Each benchmark repeats its kernel for at least this time.
+#define BENCH_MIN_SECONDS 0.25
+
+#define BENCH_OUTPUT_BYTES    (1024 * 1024)
+#define BENCH_HISTORY_ENTRIES 10000
+
+static const char *bench_commands[] = {
+    "ls",
+    "ls -la /usr/share/doc",
+    "cd ..",
+    "git status",
+    "grep -rn \"speak_audio\" main.c",
+    "make clean && make",
+    "cat /etc/os-release | head -n 3",
+    "find . -name \"*.c\" -newer Makefile -print"
+};
+
+#define BENCH_NUM_COMMANDS ((int) (sizeof(bench_commands) / sizeof(char *)))
+
+// Keeps the compiler from dropping the work of the kernels.
+volatile size_t bench_sink = 0;
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Same sequence on every run, so that the numbers are comparable.
+static unsigned int bench_random_state = 12345;
+
+static unsigned int bench_random(void) {
+    bench_random_state = bench_random_state * 1103515245u + 12345u;
+    return bench_random_state >> 8;
+}
+
+///  @brief Prints a result line.
+///  @param ops   Operations done.
+///  @param bytes Bytes processed, 0 if the kernel isn't about bytes.
+static void bench_report(const char *name, long ops, size_t bytes, double seconds) {
+    printf("%-44s %12.1f ns/op", name, seconds * 1e9 / ops);
+    if (bytes > 0) {
+        printf(" %10.1f MB/s", bytes / seconds / (1024.0 * 1024.0));
+    }
+    printf("\n");
+}
+
+static void bench_free_tokens(char **tokens) {
+    for (int i = 0; tokens[i] != NULL; i++) {
+        free(tokens[i]);
+    }
+    free(tokens);
+}
+
+// An output like the one of ls -l, of BENCH_OUTPUT_BYTES.
+static char *bench_make_output(void) {
+    char *output = malloc(BENCH_OUTPUT_BYTES + 1);
+    if (!output) {
+        fprintf(stderr, "microbench: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t len = 0;
+    int line = 0;
+    while (len < BENCH_OUTPUT_BYTES) {
+        char text[128];
+        int n = snprintf(text, sizeof(text),
+                         "-rw-r--r-- 1 pina pina %8u Aug 18 12:%02d\tfile_%05d.txt\n",
+                         bench_random() % 100000, line % 60, line);
+        if (len + n > BENCH_OUTPUT_BYTES) {
+            n = BENCH_OUTPUT_BYTES - len;
+        }
+        memcpy(output + len, text, n);
+        len += n;
+        line++;
+    }
+    output[len] = '\0';
+    return output;
+}
+
+static void bench_split_line(void) {
+    long ops = 0;
+    size_t bytes = 0;
+    double start = bench_now(), elapsed;
+    do {
+        for (int i = 0; i < BENCH_NUM_COMMANDS; i++) {
+            char *line = strdup(bench_commands[i]);
+            char **tokens = lsh_split_line(line);
+            bench_sink += tokens[0] != NULL;
+            bytes += strlen(line);
+            bench_free_tokens(tokens);
+            free(line);
+        }
+        ops += BENCH_NUM_COMMANDS;
+    } while ((elapsed = bench_now() - start) < BENCH_MIN_SECONDS);
+    bench_report("lsh_split_line ( short commands )", ops, bytes, elapsed);
+}
+
+static void bench_join_args(void) {
+    char **tokens[BENCH_NUM_COMMANDS];
+    for (int i = 0; i < BENCH_NUM_COMMANDS; i++) {
+        char *line = strdup(bench_commands[i]);
+        tokens[i] = lsh_split_line(line);
+        free(line);
+    }
+
+    long ops = 0;
+    size_t bytes = 0;
+    double start = bench_now(), elapsed;
+    do {
+        for (int i = 0; i < BENCH_NUM_COMMANDS; i++) {
+            char *joined = join_args_with_space(tokens[i]);
+            size_t len = strlen(joined);
+            bench_sink += len;
+            bytes += len;
+            free(joined);
+        }
+        ops += BENCH_NUM_COMMANDS;
+    } while ((elapsed = bench_now() - start) < BENCH_MIN_SECONDS);
+    bench_report("join_args_with_space ( short commands )", ops, bytes, elapsed);
+
+    for (int i = 0; i < BENCH_NUM_COMMANDS; i++) {
+        bench_free_tokens(tokens[i]);
+    }
+}
+
+static void bench_char_names(void) {
+    char *output = bench_make_output();
+    char *dest = alloc_char_name_buffer(BENCH_OUTPUT_BYTES, "std out: \n");
+
+    long ops = 0;
+    size_t bytes = 0;
+    double start = bench_now(), elapsed;
+    do {
+        bench_sink += replace_newline_space_tab_with_char_name(output, BENCH_OUTPUT_BYTES, dest, "std out: \n");
+        bytes += BENCH_OUTPUT_BYTES;
+        ops++;
+    } while ((elapsed = bench_now() - start) < BENCH_MIN_SECONDS);
+    bench_report("replace_newline_space_tab ( 1 MB output )", ops, bytes, elapsed);
+
+    free(dest);
+    free(output);
+}
+
+static void bench_count_match(size_t offset, const char *keyword) {
+    bench_sink += offset + (keyword != NULL);
+}
+
+static void bench_alerts(void) {
+    char *output = bench_make_output();
+    alert_config_from_env();
+    AlertScan scan;
+    alert_scan_init(&scan);
+
+    long ops = 0;
+    size_t bytes = 0;
+    double start = bench_now(), elapsed;
+    do {
+        alert_scan(&scan, output, BENCH_OUTPUT_BYTES, 0, bench_count_match);
+        bytes += BENCH_OUTPUT_BYTES;
+        ops++;
+    } while ((elapsed = bench_now() - start) < BENCH_MIN_SECONDS);
+    bench_report("alert_scan ( 1 MB output, default keywords )", ops, bytes, elapsed);
+
+    free(output);
+}
+
+static void bench_history(void) {
+    LinkedList history;
+    char entry[64];
+
+    list_init(&history);
+    double start = bench_now();
+    for (int i = 0; i < BENCH_HISTORY_ENTRIES; i++) {
+        snprintf(entry, sizeof(entry), "%s # %d", bench_commands[i % BENCH_NUM_COMMANDS], i);
+        list_append_first(&history, entry);
+    }
+    bench_report("list_append_first ( 10k history )", BENCH_HISTORY_ENTRIES, 0,
+                 bench_now() - start);
+
+    long ops = 0;
+    double elapsed;
+    start = bench_now();
+    do {
+        for (int i = 0; i < 256; i++) {
+            bench_sink += (size_t) list_get_at(&history, bench_random() % BENCH_HISTORY_ENTRIES);
+        }
+        ops += 256;
+    } while ((elapsed = bench_now() - start) < BENCH_MIN_SECONDS);
+    bench_report("list_get_at ( 10k history, random index )", ops, 0, elapsed);
+
+    list_free(&history);
+}
+
+// The keys of a typical edit: a command, corrected with backspace, then a
+// walk over the history with the arrows, and Enter.
+static const char bench_edit_keys[] =
+    "ls -la /usr/shar\x7f\x7f\x7f\x7fshare/doc"
+    "\x1b[A\x1b[A\x1b[A\x1b[B\x1b[B\x1b[C\x1b[D"
+    "\n";
+
+// A line typed without mistakes, to compare the echo modes.
+static const char bench_typed_keys[] =
+    "grep -rn speak_audio main.c | sort | head -n 20\n";
+
+static void bench_line_editor(const char *name, const char *keys, int mode) {
+    size_t num_keys = strlen(keys);
+
+    // The editor echoes to stdout and speaks, to the null backend.
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int dev_null = open("/dev/null", O_WRONLY);
+    dup2(dev_null, STDOUT_FILENO);
+    close(dev_null);
+
+    list_init(&list);
+    for (int i = 0; i < BENCH_HISTORY_ENTRIES; i++) {
+        list_append_first(&list, (char *) bench_commands[i % BENCH_NUM_COMMANDS]);
+    }
+
+    LineEditor ed;
+    memset(&ed, 0, sizeof(ed));
+    line_editor_reset(&ed);
+    echo_mode = mode;
+
+    long ops = 0;
+    size_t bytes = 0;
+    double start = bench_now(), elapsed;
+    do {
+        for (size_t i = 0; i < num_keys; i++) {
+            if (line_editor_feed(&ed, (unsigned char) keys[i])) {
+                char *line = line_editor_take(&ed);
+                bench_sink += strlen(line);
+                free(line);
+            }
+        }
+        ops += num_keys;
+        bytes += num_keys;
+    } while ((elapsed = bench_now() - start) < BENCH_MIN_SECONDS);
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    bench_report(name, ops, bytes, elapsed);
+    echo_mode = PINA_ECHO_BOTH;
+    list_free(&list);
+}
+
+int main(void) {
+    // Measures the kernels, not the speech.
+    setenv("PINA_TTS", "null", 1);
+    unsetenv("PINA_TTS_LOG");
+    unsetenv("PINA_ALERTS");
+
+    bench_split_line();
+    bench_join_args();
+    bench_char_names();
+    bench_alerts();
+    bench_history();
+    bench_line_editor("line_editor_feed ( keys and escapes )", bench_edit_keys, PINA_ECHO_BOTH);
+    bench_line_editor("line_editor_feed ( typed line, echo both )", bench_typed_keys, PINA_ECHO_BOTH);
+    bench_line_editor("line_editor_feed ( typed line, echo words )", bench_typed_keys, PINA_ECHO_WORDS);
+    bench_line_editor("line_editor_feed ( typed line, echo silent )", bench_typed_keys, PINA_ECHO_SILENT);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,90 @@
+//*****************************************************************************
+//
+//  name:   pina_shell - A screen reader shell for Linux that speaks the stdin,
+//                       the stdout and the stderr.
+//
+//  file:   pina_shell.h
+//
+//  brief:  The kernels of the shell on the hot path, the ones that run for
+//          every key, every line and every byte of output. main.c defines
+//          them, and microbench.c links with main.c, built with
+//          -DPINA_NO_MAIN, to measure them ( make microbench ).
+//
+//  License: MIT Open Source License
+//
+//*****************************************************************************
+
+#ifndef PINA_SHELL_H
+#define PINA_SHELL_H
+
+#include <stddef.h>
+
+// Node structure for a linked list
+typedef struct Node {
+    char *data;
+    struct Node *next;
+    struct Node *prev;
+} Node;
+
+// Linked list structure
+typedef struct LinkedList {
+    Node *head;
+    Node *tail;
+    int size;
+} LinkedList;
+
+// The line being typed, fed one key at a time.
+typedef struct LineEditor {
+    char *buffer;
+    int   bufsize;
+    int   position;
+    Node *node_current;           // History entry shown by the arrows.
+    int   flag_before_up_arrow;
+    int   escape_state;           // 0, 1 after Escape, 2 after Escape '['.
+    char  utf8_pending[4];        // Bytes of a code point being typed.
+    int   utf8_len;
+} LineEditor;
+
+// The history of the commands, the newest first.
+extern LinkedList list;
+
+// Tokenizer of the command line.
+char **lsh_split_line(char *line);
+char  *join_args_with_space(char **args);
+
+// Narration of the output.
+size_t replace_newline_space_tab_with_char_name(const char *src, size_t src_len, char *dest, const char *read_context_txt);
+char  *alloc_char_name_buffer(size_t src_len, const char *read_context_txt);
+
+// Keyword alerts over the output, the state of the scan of one stream.
+typedef struct AlertScan {
+    int state;
+    int line_alerted;      // The current line was already alerted.
+} AlertScan;
+
+void alert_config_from_env(void);
+void alert_scan_init(AlertScan *scan);
+void alert_scan(AlertScan *scan, const char *data, size_t len, size_t offset,
+                void (*on_match)(size_t offset, const char *keyword));
+
+// History.
+void  list_init(LinkedList *list);
+void  list_append_first(LinkedList *list, char *str);
+char *list_get_at(LinkedList *list, int index);
+void  list_free(LinkedList *list);
+
+// What the line editor speaks of the typed keys, a combination of the
+// flags: PINA_ECHO_SILENT, PINA_ECHO_CHARACTERS, PINA_ECHO_WORDS or both.
+#define PINA_ECHO_SILENT     0
+#define PINA_ECHO_CHARACTERS 1
+#define PINA_ECHO_WORDS      2
+#define PINA_ECHO_BOTH       (PINA_ECHO_CHARACTERS | PINA_ECHO_WORDS)
+
+extern int echo_mode;
+
+// Line editor, with the escape sequences of the arrows and review keys.
+void  line_editor_reset(LineEditor *ed);
+int   line_editor_feed(LineEditor *ed, int c);
+char *line_editor_take(LineEditor *ed);
+
+#endif